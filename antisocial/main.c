@@ -15,6 +15,26 @@
 #include <device.h>
 #include <calibrate.h>
 
+/*******************************************************************************
+* build options, add them to OPTIONS in the Makefile (or on the make command
+* line, e.g. make OPTIONS=-DLEDSCAN) and do a make clean before building:
+* LEDSCAN	multiplex all 40 LEDs from a framebuffer in the T16 interrupt,
+*		with brightness levels (see the LED scan engine below)
+*/
+
+/*******************************************************************************
+* controllers: the Makefile passes DEVICE on (-DPFS154, or -DPMS154C with make
+* DEVICE=PMS154C) and checks the RAM and ROM of the build against the budget
+* of the part, see there.
+* PMS154C	OTP part, pin compatible with the PFS154-S16 and with the same
+*		2K words of ROM and 128 bytes of RAM
+* The PMS150C cannot drive the board: it only has port A (PA0, PA3..PA7), and
+* the charlieplexed LEDs need PB0..PB7 as well.
+*/
+#ifdef PMS150C
+#error "the PMS150C has no port B for the LEDs, use the PMS154C"
+#endif
+
 /*******************************************************************************
 * configure/calibrate system clock source
 */
@@ -29,44 +49,106 @@ unsigned char _sdcc_external_startup(void)
 
 
 /*******************************************************************************
-* provide arduino-like millis() functionality using T16
+* millisecond timebase using T16
 * T16 can be clocked from several sources, use a clock divider and can generate
 * an interruput when a certain bit (8..15) changes.
-* We assume the IHRC is calibrated to 16MHz, then dividing by 64 will produce
-* a 250 KHz input clock to T16. After 256 clock pulses bit 8 will toggle, which
-* is almost once a millisecond. To make it exactly once a millisecond, we should
-* load T16 (which is an up-counter) with the value 6.
+* T16 is clocked from the IHRC oscillator itself, not from the system clock.
+* The IHRC runs at 16MHz: SYSCLOCK_IHRC_4MHZ divides it by 4 for the system
+* clock, and calibrating that to 4MHz in _sdcc_external_startup() calibrates
+* the IHRC to 16MHz. Dividing by 16 gives a 1MHz input clock to T16.
+*
+* T16 is never written, it runs freely and bit 8 goes high every 512 counts,
+* every 512 us. Reloading it in the interrupt would lose the counts that pass
+* before the reload (the interrupt entry latency), which made every tick a few
+* us too long. Instead the interrupt adds t16step to an error accumulator,
+* t16acc, and counts a tick every time that reaches TICK_UNITS. The
+* accumulator counts in 1/16 us (1/32 us with LEDSCAN), so TICK_UNITS is one
+* millisecond and T16_UNITS is one T16 interrupt period. With t16step at
+* T16_UNITS the ticks are exactly 1000 us on average, with no systematic error
+* (0 ppm) on top of the IHRC calibration error. A single tick may come up to
+* one T16 period early or late.
+*
+* Changing t16step by one unit changes the tick rate by 1/T16_UNITS, 122 ppm
+* (244 ppm with LEDSCAN). The cooperative badge uses that to follow the clock
+* of the group, see learndrift().
+*
+* The interrupt counts milliseconds in the 16 bit tickcount, which wraps every
+* 65.5 seconds. All timing is done on differences between two tick values,
+* which unsigned arithmetic keeps correct across the wrap as long as the
+* interval itself is shorter than the wrap period:
+* ticks() returns the full 16 bit count. That takes two byte reads, so it reads
+*   until it gets the same value twice instead of masking the interrupt.
+* ticks8() returns just the low byte, a single (atomic) read. That is all the
+*   hot paths need, as they only measure intervals well below 256 ms.
+* elapsed() and elapsed8() return the wrap-safe number of ticks since <t>.
 */
-volatile uint32_t elapsedmillis;  // overflows after 49.71 days
+volatile uint16_t tickcount;
+
+uint16_t ticks() {
+	uint16_t current;
+	do {
+		current = tickcount;
+	} while (current != tickcount);
+	return(current);
+}
 
-void setup_millis() {
-	T16M = (uint8_t)(T16M_CLK_IHRC | T16M_CLK_DIV64 | T16M_INTSRC_8BIT);
-	T16C=6;
-	elapsedmillis=0;
+#define ticks8()	(*(volatile uint8_t *)&tickcount)	// little endian
+#define elapsed(t)	((uint16_t)(ticks() - (t)))
+#define elapsed8(t)	((uint8_t)(ticks8() - (uint8_t)(t)))
+
+#ifdef LEDSCAN
+// the scan engine needs a faster interrupt: divide by 4 for 4MHz, bit 8 then
+// goes high every 128 us
+#define T16M_TICK	(T16M_CLK_IHRC | T16M_CLK_DIV4 | T16M_INTSRC_8BIT)
+#define TICK_UNITS	32000		// 1 ms in 1/32 us
+#define T16_UNITS	4096		// 128 us between T16 interrupts
+#else
+#define T16M_TICK	(T16M_CLK_IHRC | T16M_CLK_DIV16 | T16M_INTSRC_8BIT)
+#define TICK_UNITS	16000		// 1 ms in 1/16 us
+#define T16_UNITS	8192		// 512 us between T16 interrupts
+#endif
+
+uint16_t t16acc;		// time since the last tick, in TICK_UNITS/ms
+uint16_t t16step;		// added to t16acc every T16 interrupt
+
+void setup_ticks() {
+	T16M = (uint8_t)(T16M_TICK);
+	t16acc=0;
+	t16step=T16_UNITS;
+	tickcount=0;
 	INTEN |= INTEN_T16;
 }
 
+#ifdef LEDSCAN
+void scanleds(void);		// see the LED scan engine below
+#endif
+
 /*******************************************************************************
 * Interrupt dispatcher - only T16 is used
 */
 void interrupt(void) __interrupt(0) {
 	if (INTRQ & INTRQ_T16) {
 		INTRQ &= ~INTRQ_T16; // Mark as processed
-		elapsedmillis++;
-		T16C=6;
+#ifdef LEDSCAN
+		scanleds();
+#endif
+		t16acc += t16step;
+		if (t16acc >= TICK_UNITS) {
+			t16acc -= TICK_UNITS;
+			tickcount++;
+		}
 	}
 }
 
 /*******************************************************************************
-* 32 bit operations are non-atomic on this 8 bit microcontroller, so we must
-* disable the T16 interrupt and then re-enable it after reading the value
+* idle() puts the core in power-save mode (STOPEXE) until something happens.
+* Unlike STOPSYS, STOPEXE only stops the CPU: the IHRC keeps running, so T16
+* keeps counting and TM2 keeps generating the IR carrier. The core wakes up on
+* the next T16 interrupt (every 512 us, or every 128 us with LEDSCAN). All
+* digital inputs are disabled in PADIER/PBDIER (see setup()), so no pin change
+* wakes the core. Interrupts are serviced right after wake-up.
 */
-uint32_t millis() {
-	INTEN &= ~INTEN_T16;
-	uint32_t current = elapsedmillis;
-	INTEN |= INTEN_T16;
-	return(current);
-}
+#define idle() __stopexe()
 
 
 /*******************************************************************************
@@ -77,7 +159,8 @@ uint32_t millis() {
 * well as implement intermediate brightness levels, but one has to take into
 * account a lot more details - individual pin drive strength, charlieplexing
 * level (20x) and the speed (~20 frames/s) necessary to make persistence of
-* vision work, and this is outside the (KISS) scope of this project
+* vision work, and this is outside the (KISS) scope of this project. Builds
+* with the LEDSCAN option do exactly that anyway, see the LED scan engine.
 *
 * When viewed on the PCB, in this file the LEDs are numbered as follows: 
 *
@@ -140,72 +223,179 @@ uint32_t millis() {
  
  
 /*******************************************************************************
-* this function takes the number of the LED on the left and right sides that
+* setled() uses one lookup table per side. For every LED the table holds the
+* pins that must be driven (the direction bits for PAC and PBC) and which of
+* those must be driven high (the level bits for PA and PB). Entry LED_OFF has
+* no pins driven, which switches that side off.
+*
+* Only the pins belonging to one side are ever touched (PA7 and PB4..PB7 on
+* the left, PA0 and PB0..PB3 on the right), so the IR pins PA3/PA4 and the
+* other side are left alone.
+*/
+#define LED_OFF		20		// index that switches a side off
+
+#define LEFT_PA		0x80		// PA7
+#define LEFT_PB		0xf0		// PB4..PB7
+#define RIGHT_PA	0x01		// PA0
+#define RIGHT_PB	0x0f		// PB0..PB3
+
+typedef struct {
+	uint8_t pac;			// PA pins driven
+	uint8_t pa;			// PA pins driven high
+	uint8_t pbc;			// PB pins driven
+	uint8_t pb;			// PB pins driven high
+} ledpins_t;
+
+const ledpins_t leftpins[LED_OFF+1] = {
+	{ 0x80, 0x00, 0x10, 0x10 },	// L00
+	{ 0x00, 0x00, 0x90, 0x10 },	// L01
+	{ 0x00, 0x00, 0x50, 0x10 },	// L02
+	{ 0x00, 0x00, 0x30, 0x10 },	// L03
+	{ 0x80, 0x00, 0x20, 0x20 },	// L04
+	{ 0x00, 0x00, 0xa0, 0x20 },	// L05
+	{ 0x00, 0x00, 0x60, 0x20 },	// L06
+	{ 0x00, 0x00, 0x30, 0x20 },	// L07
+	{ 0x80, 0x00, 0x40, 0x40 },	// L08
+	{ 0x00, 0x00, 0xc0, 0x40 },	// L09
+	{ 0x00, 0x00, 0x60, 0x40 },	// L10
+	{ 0x00, 0x00, 0x50, 0x40 },	// L11
+	{ 0x80, 0x00, 0x80, 0x80 },	// L12
+	{ 0x00, 0x00, 0xc0, 0x80 },	// L13
+	{ 0x00, 0x00, 0xa0, 0x80 },	// L14
+	{ 0x00, 0x00, 0x90, 0x80 },	// L15
+	{ 0x80, 0x80, 0x80, 0x00 },	// L16
+	{ 0x80, 0x80, 0x40, 0x00 },	// L17
+	{ 0x80, 0x80, 0x20, 0x00 },	// L18
+	{ 0x80, 0x80, 0x10, 0x00 },	// L19
+	{ 0x00, 0x00, 0x00, 0x00 }	// LED_OFF
+};
+
+const ledpins_t rightpins[LED_OFF+1] = {
+	{ 0x01, 0x00, 0x08, 0x08 },	// R00
+	{ 0x00, 0x00, 0x09, 0x08 },	// R01
+	{ 0x00, 0x00, 0x0a, 0x08 },	// R02
+	{ 0x00, 0x00, 0x0c, 0x08 },	// R03
+	{ 0x01, 0x00, 0x04, 0x04 },	// R04
+	{ 0x00, 0x00, 0x05, 0x04 },	// R05
+	{ 0x00, 0x00, 0x06, 0x04 },	// R06
+	{ 0x00, 0x00, 0x0c, 0x04 },	// R07
+	{ 0x01, 0x00, 0x02, 0x02 },	// R08
+	{ 0x00, 0x00, 0x03, 0x02 },	// R09
+	{ 0x00, 0x00, 0x06, 0x02 },	// R10
+	{ 0x00, 0x00, 0x0a, 0x02 },	// R11
+	{ 0x01, 0x00, 0x01, 0x01 },	// R12
+	{ 0x00, 0x00, 0x03, 0x01 },	// R13
+	{ 0x00, 0x00, 0x05, 0x01 },	// R14
+	{ 0x00, 0x00, 0x09, 0x01 },	// R15
+	{ 0x01, 0x01, 0x01, 0x00 },	// R16
+	{ 0x01, 0x01, 0x02, 0x00 },	// R17
+	{ 0x01, 0x01, 0x04, 0x00 },	// R18
+	{ 0x01, 0x01, 0x08, 0x00 },	// R19
+	{ 0x00, 0x00, 0x00, 0x00 }	// LED_OFF
+};
+
+
+/*******************************************************************************
+* driveleds() takes the number of the LED on the left and right sides that
 * should be switched ON as arguments
-* if an argument is 20, then LEDs on the corresponding side are switched OFF
+* if an argument is 20 (LED_OFF), then LEDs on the corresponding side are
+* switched OFF
 * if an argument is >=21, then the corresponding side is left unchanged
+*
+* Every side is first released (all its pins HiZ), then the new levels are
+* written and only then the new pin pair is driven. The ports therefore never
+* pass through a state in which some other LED could light up.
 */
-void setled(int8_t left,int8_t right)
+void driveleds(uint8_t left, uint8_t right)
 {
-	if ( left < 21 )
+	if ( left <= LED_OFF )
 	{
-		PAC &= 0x7f; PBC &= 0x0f; // disable all left outputs
-		switch (left)
-		{
-			case 0: PA &= 0x7f; PAC |= 0x80; PB |= 0x10; PBC |= 0x10; break;
-			case 1: PB &= 0x7f; PBC |= 0x80; PB |= 0x10; PBC |= 0x10; break;
-			case 2: PB &= 0xbf; PBC |= 0x40; PB |= 0x10; PBC |= 0x10; break;
-			case 3: PB &= 0xdf; PBC |= 0x20; PB |= 0x10; PBC |= 0x10; break;
-			case 4: PA &= 0x7f; PAC |= 0x80; PB |= 0x20; PBC |= 0x20; break;
-			case 5: PB &= 0x7f; PBC |= 0x80; PB |= 0x20; PBC |= 0x20; break;
-			case 6: PB &= 0xbf; PBC |= 0x40; PB |= 0x20; PBC |= 0x20; break;
-			case 7: PB &= 0xef; PBC |= 0x10; PB |= 0x20; PBC |= 0x20; break;
-			case 8: PA &= 0x7f; PAC |= 0x80; PB |= 0x40; PBC |= 0x40; break;
-			case 9: PB &= 0x7f; PBC |= 0x80; PB |= 0x40; PBC |= 0x40; break;
-			case 10: PB &= 0xdf; PBC |= 0x20; PB |= 0x40; PBC |= 0x40; break;
-			case 11: PB &= 0xef; PBC |= 0x10; PB |= 0x40; PBC |= 0x40; break;
-			case 12: PA &= 0x7f; PAC |= 0x80; PB |= 0x80; PBC |= 0x80; break;
-			case 13: PB &= 0xbf; PBC |= 0x40; PB |= 0x80; PBC |= 0x80; break;
-			case 14: PB &= 0xdf; PBC |= 0x20; PB |= 0x80; PBC |= 0x80; break;
-			case 15: PB &= 0xef; PBC |= 0x10; PB |= 0x80; PBC |= 0x80; break;
-			case 16: PB &= 0x7f; PBC |= 0x80; PA |= 0x80; PAC |= 0x80; break;
-			case 17: PB &= 0xbf; PBC |= 0x40; PA |= 0x80; PAC |= 0x80; break;
-			case 18: PB &= 0xdf; PBC |= 0x20; PA |= 0x80; PAC |= 0x80; break;
-			case 19: PB &= 0xef; PBC |= 0x10; PA |= 0x80; PAC |= 0x80; break;
-			default: break; // left side off
-		}
+		PAC &= ~LEFT_PA; PBC &= ~LEFT_PB; // disable all left outputs
+		PA = (PA & ~LEFT_PA) | leftpins[left].pa;
+		PB = (PB & ~LEFT_PB) | leftpins[left].pb;
+		PAC |= leftpins[left].pac;
+		PBC |= leftpins[left].pbc;
 	}
-	if ( right < 21 )
+	if ( right <= LED_OFF )
 	{
-		PAC &= 0xfe; PBC &= 0xf0; // disable all right outputs		
-		switch (right)
-		{
-			case 0: PA &= 0xfe; PAC |= 0x01; PB |= 0x08; PBC |= 0x08; break;
-			case 1: PB &= 0xfe; PBC |= 0x01; PB |= 0x08; PBC |= 0x08; break;
-			case 2: PB &= 0xfd; PBC |= 0x02; PB |= 0x08; PBC |= 0x08; break;
-			case 3: PB &= 0xfb; PBC |= 0x04; PB |= 0x08; PBC |= 0x08; break;
-			case 4: PA &= 0xfe; PAC |= 0x01; PB |= 0x04; PBC |= 0x04; break;
-			case 5: PB &= 0xfe; PBC |= 0x01; PB |= 0x04; PBC |= 0x04; break;
-			case 6: PB &= 0xfd; PBC |= 0x02; PB |= 0x04; PBC |= 0x04; break;
-			case 7: PB &= 0xf7; PBC |= 0x08; PB |= 0x04; PBC |= 0x04; break;
-			case 8: PA &= 0xfe; PAC |= 0x01; PB |= 0x02; PBC |= 0x02; break;
-			case 9: PB &= 0xfe; PBC |= 0x01; PB |= 0x02; PBC |= 0x02; break;
-			case 10: PB &= 0xfb; PBC |= 0x04; PB |= 0x02; PBC |= 0x02; break;
-			case 11: PB &= 0xf7; PBC |= 0x08; PB |= 0x02; PBC |= 0x02; break;
-			case 12: PA &= 0xfe; PAC |= 0x01; PB |= 0x01; PBC |= 0x01; break;
-			case 13: PB &= 0xfd; PBC |= 0x02; PB |= 0x01; PBC |= 0x01; break;
-			case 14: PB &= 0xfb; PBC |= 0x04; PB |= 0x01; PBC |= 0x01; break;
-			case 15: PB &= 0xf7; PBC |= 0x08; PB |= 0x01; PBC |= 0x01; break;
-			case 16: PB &= 0xfe; PBC |= 0x01; PA |= 0x01; PAC |= 0x01; break;
-			case 17: PB &= 0xfd; PBC |= 0x02; PA |= 0x01; PAC |= 0x01; break;
-			case 18: PB &= 0xfb; PBC |= 0x04; PA |= 0x01; PAC |= 0x01; break;
-			case 19: PB &= 0xf7; PBC |= 0x08; PA |= 0x01; PAC |= 0x01; break;
-			default: break; // right side <off
-		}
+		PAC &= ~RIGHT_PA; PBC &= ~RIGHT_PB; // disable all right outputs
+		PA = (PA & ~RIGHT_PA) | rightpins[right].pa;
+		PB = (PB & ~RIGHT_PB) | rightpins[right].pb;
+		PAC |= rightpins[right].pac;
+		PBC |= rightpins[right].pbc;
 	}
 }
 
 
+#ifdef LEDSCAN
+/*******************************************************************************
+* LED scan engine
+* With LEDSCAN the pattern code does not drive the ports itself. It writes the
+* brightness of the LEDs into a framebuffer, and the T16 interrupt multiplexes
+* all 40 LEDs from there. T16 then interrupts every 128 us and every interrupt
+* shows one phase: in phase n only L<n> and R<n> can be lit (the two sides use
+* separate pins, so they are driven at the same time). A frame of all 20
+* phases takes 2.56 ms, 390 frames/s.
+*
+* Every LED has a level from 0 (off) to LED_LEVELS (fully on), made by pulse
+* width modulation over LED_LEVELS frames: in frame f a LED is lit when its
+* level is above f, so with 3 levels the PWM period is 7.7 ms (130 Hz). A fully
+* on LED is lit during 1 of the 20 phases, which is a lot dimmer than a LED
+* that driveleds() drives all the time without LEDSCAN.
+*
+* framebuffer[n] holds the level of L<n> in the high and of R<n> in the low
+* nibble. The interrupt only reads it, one byte per phase, and the pattern code
+* only writes it, so there is no need to mask interrupts. Each interrupt does
+* the same fixed work: one framebuffer read, two compares and driveleds().
+*/
+#define LED_LEVELS	3		// brightness of a fully lit LED
+
+uint8_t framebuffer[LED_OFF];		// L<n> level << 4 | R<n> level
+uint8_t scanphase;			// phase shown by the last interrupt
+uint8_t scanframe;			// frame number within the PWM period
+
+#define setleft(n,level)	(framebuffer[n] = (framebuffer[n] & 0x0f) | ((level) << 4))
+#define setright(n,level)	(framebuffer[n] = (framebuffer[n] & 0xf0) | (level))
+
+void scanleds(void)
+{
+	if (++scanphase == LED_OFF)
+	{
+		scanphase = 0;
+		if (++scanframe == LED_LEVELS) scanframe = 0;
+	}
+	uint8_t levels = framebuffer[scanphase];
+	driveleds( (levels >> 4) > scanframe ? scanphase : LED_OFF,
+		   (levels & 0x0f) > scanframe ? scanphase : LED_OFF );
+}
+
+void setup_scan(void)
+{
+	for (uint8_t i=0; i<LED_OFF; i++) framebuffer[i] = 0;
+	scanphase = 0;
+	scanframe = 0;
+}
+
+
+/*******************************************************************************
+* setled() keeps the interface of driveleds() for the patterns: it fully
+* lights the LED on the left and right sides given as arguments in the
+* framebuffer and switches off all others, 20 (LED_OFF) switches a side off
+* and >=21 leaves a side unchanged
+*/
+void setled(uint8_t left, uint8_t right)
+{
+	for (uint8_t i=0; i<LED_OFF; i++)
+	{
+		if (left <= LED_OFF) setleft(i, i == left ? LED_LEVELS : 0);
+		if (right <= LED_OFF) setright(i, i == right ? LED_LEVELS : 0);
+	}
+}
+#else
+#define setled(left,right)	driveleds(left,right)
+#endif
+
+
 /*******************************************************************************
 * The badge shows a programmed sequence.
 * The complete sequence is divided into "states".
@@ -222,15 +412,15 @@ void setled(int8_t left,int8_t right)
 * zero. KISS. It is probably also possible to deal with synchronization using
 * interrupts, which might actually be just as easy...
 *
-* The main program cycles through the states, calls the appropriate pattern
-* routine that repeats it pattern N times. At every step in a pattern the
+* The main program cycles through the states, one for every part of
+* sequence[], and plays the pattern of that part N times. At every step the
 * waituntil() function is called to wait some time before proceeding to the
 * next step in the pattern. The IR receiver is checked in the waituntil()
 * function.
 */
 
 uint8_t state;			// The state of the main loop
-uint32_t previoustime;          // The last time the LEDs were updated
+uint16_t previoustime;          // The last time the LEDs were updated
 uint8_t previouspinstate;	// The last state of the IR receiver pin
 
 
@@ -238,14 +428,13 @@ uint8_t previouspinstate;	// The last state of the IR receiver pin
 * waituntil() waits for at most <time> milliseconds
 * returns 0 in case of a timeout (normal)
 */
-uint8_t waituntil(int16_t time)
+uint8_t waituntil(uint8_t time)
 {
-	uint32_t currenttime = millis();
-
-	while (currenttime - previoustime < time)
+	while (elapsed8(previoustime) < time)
 	{    
-		currenttime = millis();
+		idle();
 	}
+	previoustime += time;
 	return(0);
 }
 
@@ -285,6 +474,9 @@ void setup() { // Arduino-like setup function called once after power on
   	// PA1 and PA2 are not available on the package
   	PAPH = 0x76;
 	PBPH = 0x00;
+	// no pin is used as an input, so no pin change can wake the core from idle()
+	PADIER = 0x00;
+	PBDIER = 0x00;
   	// set registers low
   	PA=0x00;
   	PB=0x00;
@@ -295,146 +487,198 @@ void setup() { // Arduino-like setup function called once after power on
 	
 	spamIR(); // be antisocial and start spamming a 38kHz IR signal continuously
   
-	setup_millis();
+	setup_ticks();
+#ifdef LEDSCAN
+	setup_scan();
+#endif
 
 	INTRQ = 0;
 	__engint();                     // Enable global interrupts
-	previoustime=millis();
+	previoustime=ticks();
 	previouspinstate=1;
 	state=0;
 }
 
 
 /*******************************************************************************
-* individual pattern functions - with the number of repeats as a parameter
-* singleledccw		singleledcw
-* twoledsccw		twoledscw 
-* twoledsflapdown	twoledsflapup 
-* twoledsflap		twoledsrandom 
+* Patterns are not hand-written functions but ROM data, played by play().
+*
+* Every pattern is a list of "runs". A run takes RUN_STEPS steps, one for every
+* LED on a side (so a run on its own looks like a LED walking along one side).
+* For each side a run holds a "track" byte that tells which LED is lit at
+* step i of the run:
+* bit 7 = 1 -> count down from the start index (start-i), 0 -> up (start+i)
+* bit 6 = 1 -> look the index up in the LED table, 0 -> it is the LED itself
+* bits 5:0 -> start index (0..39 for the LED table, 0..19 for a LED)
+* A track that starts at LED_OFF and does not use the LED table keeps its
+* side off. Both sides mirrored, running opposite or independently are just
+* different combinations of the two track bytes.
+*
+* A pattern is a slice of consecutive runs plus the time of one step, packed
+* in two bytes by PATTERN(), and the sequence (see SEQUENCE()) plays every
+* pattern a number of times. Patterns may share
+* runs: twoledsflap is twoledsflapdown followed by twoledsflapup.
+*
+* Adding a pattern means adding runs and a PATTERNS() entry, not code.
 */
-void singleledccw(uint8_t n)
-{
-  	for (uint8_t r=0; r<n; r++)
-	{
-		for (int8_t i=0; i<20; i++)
-		{
-			setled(i,20);
-                        if (waituntil(25)) {return; }
-		}
-		for (int8_t i=0; i<20; i++)
-		{
-			setled(20,19-i);
-			if (waituntil(25)) {return; }
-		}
-	}
-}
+#define RUN_STEPS	20		// steps in a run, one per LED on a side
 
-void singleledcw(uint8_t n)
-{
-  	for (uint8_t r=0; r<n; r++)
-	{
-		for (int8_t i=0; i<20; i++)
-		{
-			setled(20,i);
-			if (waituntil(25)) {return; }
-		}
-		for (int8_t i=0; i<20; i++)
-		{
-			setled(19-i,20);
-			if (waituntil(25)) {return; }
-		}
-	}
-}
+#define TRACK_UP	0x00		// start+i
+#define TRACK_DOWN	0x80		// start-i
+#define TRACK_TABLE	0x40		// ledtable(start+i) or (start-i)
+#define TRACK_START	0x3f		// start index
+#define TRACK_OFF	(TRACK_UP | LED_OFF)	// side stays off
 
-void twoledsccw(uint8_t n)
-{
-  	for (uint8_t r=0; r<n; r++)
-	{
-		for (int8_t i=0; i<20; i++)
-		{
-			setled(i,19-i);
-			if (waituntil(25)) {return; }
-		}
-	}
-}
+typedef struct {
+	uint8_t left;			// track for the left side
+	uint8_t right;			// track for the right side
+} run_t;
 
-void twoledscw(uint8_t n)
-{
-  	for (uint8_t r=0; r<n; r++)
-	{
-		for (int8_t i=0; i<20; i++)
-		{
-			setled(19-i,i);
-			if (waituntil(25)) {return; }
-		}
-	}
-}
+typedef struct {
+	uint8_t runs;			// first run << 3 | number of runs - 1
+	uint8_t steptime;		// milliseconds per step
+} pattern_t;
 
-void twoledsflapdown(uint8_t n)
-{
-  	for (uint8_t r=0; r<n; r++)
-	{
-		for (int8_t i=0; i<20; i++)
-		{
-			setled(i,i);
-			if (waituntil(25)) {return; }
-		}
-	}
-}
+// <count> (1..8) runs starting at run <first> (0..31) of runs[]
+#define PATTERN(first,count,steptime)	{ (first) << 3 | ((count) - 1), (steptime) }
 
-void twoledsflapup(uint8_t n)
+/*******************************************************************************
+* ROM holds every constant byte as one instruction word (a RET k), so tables
+* are packed where that pays off. A LED index only needs 5 bits: PACK5() packs
+* 8 of them into 5 bytes, lowest bit first, and ledtable() extracts index <n>
+* again. That takes a few dozen cycles, nothing compared to a step, and works
+* the same for tracks counting up and down. ledsequence[] holds the 40 indices
+* of the random patterns in 25 bytes instead of 40. The bit position n*5 is
+* computed in 8 bits, so a packed table holds at most 51 indices.
+*/
+#define PACK5(a,b,c,d,e,f,g,h) \
+	(uint8_t)((a) | (b) << 5), (uint8_t)((b) >> 3 | (c) << 2 | (d) << 7), \
+	(uint8_t)((d) >> 1 | (e) << 4), (uint8_t)((e) >> 4 | (f) << 1 | (g) << 6), \
+	(uint8_t)((g) >> 2 | (h) << 3)
+
+const uint8_t ledsequence[] = {
+	PACK5( 9,19, 3, 2,16,17, 6,18),
+	PACK5( 1, 8, 0,14,15, 5, 7,10),
+	PACK5(11,12, 4,10,10, 1,15, 8),
+	PACK5(17, 9, 6,16, 7,13,11, 0),
+	PACK5( 2, 3, 4,18,12,14, 5,19)
+};
+
+uint8_t ledtable(uint8_t n)
 {
-  	for (uint8_t r=0; r<n; r++)
-	{
-		for (int8_t i=0; i<20; i++)
-		{
-			setled(19-i,19-i);
-			if (waituntil(25)) {return; }
-		}
-	}
+	uint8_t bit = n * 5;
+	uint8_t byte = bit >> 3;
+	uint16_t bits = ledsequence[byte];
+
+	bit &= 7;
+	if (bit > 3) bits |= (uint16_t)ledsequence[byte+1] << 8; // straddles two bytes
+	return((bits >> bit) & 0x1f);
 }
 
-void twoledsflap(uint8_t n)
+const run_t runs[] = {
+	{ TRACK_UP | 0, TRACK_OFF },				// 0: singleledccw
+	{ TRACK_OFF, TRACK_DOWN | 19 },
+	{ TRACK_OFF, TRACK_UP | 0 },				// 2: singleledcw
+	{ TRACK_DOWN | 19, TRACK_OFF },
+	{ TRACK_UP | 0, TRACK_DOWN | 19 },			// 4: twoledsccw
+	{ TRACK_DOWN | 19, TRACK_UP | 0 },			// 5: twoledscw
+	{ TRACK_UP | 0, TRACK_UP | 0 },				// 6: twoledsflapdown
+	{ TRACK_DOWN | 19, TRACK_DOWN | 19 },			// 7: twoledsflapup
+	{ TRACK_TABLE | TRACK_UP | 0, TRACK_TABLE | TRACK_UP | 20 },	// 8: twoledsrandom
+	{ TRACK_TABLE | TRACK_UP | 20, TRACK_TABLE | TRACK_UP | 0 },
+	{ TRACK_TABLE | TRACK_DOWN | 19, TRACK_TABLE | TRACK_DOWN | 39 },
+	{ TRACK_TABLE | TRACK_DOWN | 39, TRACK_TABLE | TRACK_DOWN | 19 }
+};
+
+/*******************************************************************************
+* The patterns by name: first run, number of runs and ms per step. PATTERNS()
+* generates the names, patterns[] and the length of one play of every pattern
+* in ticks, <name>_TICKS (an int, so at most 32767 ms).
+*/
+#define PATTERNS(X) \
+	X(SINGLELEDCCW,		0, 2, 25) \
+	X(SINGLELEDCW,		2, 2, 25) \
+	X(TWOLEDSCCW,		4, 1, 25) \
+	X(TWOLEDSCW,		5, 1, 25) \
+	X(TWOLEDSFLAPDOWN,	6, 1, 25) \
+	X(TWOLEDSFLAPUP,	7, 1, 25) \
+	X(TWOLEDSFLAP,		6, 2, 25) \
+	X(TWOLEDSRANDOM,	8, 4, 25)
+
+#define PATTERN_NAME(name,first,count,steptime)		name,
+#define PATTERN_TICKS(name,first,count,steptime)	name##_TICKS = (count) * RUN_STEPS * (steptime),
+#define PATTERN_ENTRY(name,first,count,steptime)	PATTERN(first, count, steptime),
+
+enum { PATTERNS(PATTERN_NAME) };
+enum { PATTERNS(PATTERN_TICKS) };
+const pattern_t patterns[] = { PATTERNS(PATTERN_ENTRY) };
+
+/*******************************************************************************
+* The sequence: the patterns in the order they are played, and how many times
+* each is played in a row. SEQUENCE() generates sequence[], which loop() steps
+* through, and SEQUENCE_TICKS, the length of the whole sequence in ms. It is
+* as long as that of the cooperative badge, in a different order.
+*/
+#define SEQUENCE(X) \
+	X(TWOLEDSFLAP,		4) \
+	X(TWOLEDSCCW,		8) \
+	X(TWOLEDSCW,		8) \
+	X(SINGLELEDCCW,		4) \
+	X(TWOLEDSRANDOM,	4) \
+	X(SINGLELEDCW,		4) \
+	X(TWOLEDSFLAPDOWN,	8) \
+	X(TWOLEDSFLAPUP,	8)
+
+typedef struct {
+	uint8_t pattern;		// see PATTERNS()
+	uint8_t repeats;		// plays in a row
+} part_t;
+
+#define SEQUENCE_ENTRY(pattern,repeats)	{ (pattern), (repeats) },
+#define SEQUENCE_PART(pattern,repeats)	+ (uint32_t)(repeats) * pattern##_TICKS
+
+const part_t sequence[] = { SEQUENCE(SEQUENCE_ENTRY) };
+
+#define SEQUENCE_PARTS	(sizeof(sequence) / sizeof(sequence[0]))
+#define SEQUENCE_TICKS	((uint16_t)(0 SEQUENCE(SEQUENCE_PART)))	// 36000 ms
+
+
+/*******************************************************************************
+* ledindex() returns the LED for step <i> of a track
+*/
+uint8_t ledindex(uint8_t track, uint8_t i)
 {
-  	for (uint8_t r=0; r<n; r++)
+	uint8_t n = track & TRACK_START;
+
+	if (track & TRACK_TABLE)
 	{
-		for (int8_t i=0; i<20; i++)
-		{
-			setled(i,i);
-			if (waituntil(25)) {return; }
-		}
-		for (int8_t i=0; i<20; i++)
-		{
-			setled(19-i,19-i);
-			if (waituntil(25)) {return; }
-		}
+		if (track & TRACK_DOWN) n -= i; else n += i;
+		return(ledtable(n));
 	}
+	if (n >= LED_OFF) return(LED_OFF);
+	if (track & TRACK_DOWN) return(n - i);
+	return(n + i);
 }
 
-uint8_t const randomsequence[]={ 9,19,3,2,16,17,6,18,1,8,0,14,15,5,7,10,11,12,4,10,10,1,15,8,17,9,6,16,7,13,11,0,2,3,4,18,12,14,5,19 };
-void twoledsrandom(uint8_t n)
+
+/*******************************************************************************
+* play() plays <pattern> <n> times, and stops early on a sync pulse
+*/
+void play(uint8_t pattern, uint8_t n)
 {
-  	for (uint8_t r=0; r<n; r++)
+	uint8_t first = patterns[pattern].runs >> 3;
+	uint8_t last = first + (patterns[pattern].runs & 7) + 1;
+	uint8_t steptime = patterns[pattern].steptime;
+
+	for (uint8_t r=0; r<n; r++)
 	{
-		for (int8_t i=0; i<20; i++)
-		{
-			setled(randomsequence[i],randomsequence[i+20]);
-			if (waituntil(25)) {return; }
-		}
-		for (int8_t i=0; i<20; i++)
-		{
-			setled(randomsequence[i+20],randomsequence[i]);
-			if (waituntil(25)) {return; }
-		}
-		for (int8_t i=0; i<20; i++)
-		{
-			setled(randomsequence[19-i],randomsequence[39-i]);
-			if (waituntil(25)) {return; }
-		}
-		for (int8_t i=0; i<20; i++)
+		for (uint8_t k=first; k<last; k++)
 		{
-			setled(randomsequence[39-i],randomsequence[19-i]);
-			if (waituntil(25)) {return; }
+			for (uint8_t i=0; i<RUN_STEPS; i++)
+			{
+				setled(ledindex(runs[k].left,i),ledindex(runs[k].right,i));
+				if (waituntil(steptime)) {return; }
+			}
 		}
 	}
 }
@@ -445,20 +689,13 @@ void twoledsrandom(uint8_t n)
 */
 void loop()
 {
-	state++; // pre-switch-statement increment - if state is reset, this will immediately increment it, so first state is 1
-	switch (state)
+	state++; // pre-increment - if state is reset, this will immediately increment it, so first state is 1
+	if (state <= SEQUENCE_PARTS)
 	{
-		case 1:	twoledsflap(4); break;
-		case 2:	twoledsccw(8); break;
-		case 3:	twoledscw(8); break;
-		case 4:	singleledccw(4); break;
-		case 5:	twoledsrandom(4); break;
-		case 6:	singleledcw(4); break;
-		case 7:	twoledsflapdown(8); break;
-		case 8:	twoledsflapup(8); break;
-		default: state=0; // will immediately be incremented
-		break;
+		play(sequence[state-1].pattern, sequence[state-1].repeats);
+		return;
 	}
+	state=0; // will immediately be incremented
 }
 
 
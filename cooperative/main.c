@@ -2,10 +2,10 @@
 * (c) 2023 by Theo Borm
 * see LICENSE file in the root directory of this repository
 *
-* Controls the LEDs on the "label"-badge. Synchronizes badges using IR pulses
+* Controls the LEDs on the "label"-badge. Synchronizes badges using IR frames
 *
-* cooperative version - transmitting one 25ms pulse per cycle of LED patterns
-* to allow peaceful co-existence
+* cooperative version - transmitting one short frame every two cycles of LED
+* patterns at most, to allow peaceful co-existence
 *
 * Uses a timer T16 interrupt for delays.
 * Uses timer T2 to generate 38Khz IR modulation signal
@@ -15,57 +15,812 @@
 #include <device.h>
 #include <calibrate.h>
 
+/*******************************************************************************
+* build options, add them to OPTIONS in the Makefile (or on the make command
+* line, e.g. make OPTIONS=-DLEDSCAN) and do a make clean before building:
+* LEDSCAN	multiplex all 40 LEDs from a framebuffer in the T16 interrupt,
+*		with brightness levels (see the LED scan engine below)
+* HARDSYNC	reset the sequence to state 0 on every sync frame (the original
+*		scheme) instead of coupling the phase (see rxtask())
+* INSTRUMENT	keep timing counters and make them visible on PA5/PA6 (see
+*		the instrumentation section below)
+* TRACE		log the last sync events in a small ring buffer and send it on
+*		PA5 once per sequence (see the sync trace below)
+* BATTERYSAVER	low power profile: LEDs at a quarter duty cycle (a third with
+*		LEDSCAN) and half the T16 interrupts, same sync protocol and
+*		timing as the normal profile (see the timebase and setled())
+* BADGE_GROUP=n	sync only with badges of group n (0..15, default 0), see the
+*		IR frames below
+* F_CPU=n	system clock in Hz, 4000000 (default), 2000000 or 1000000. Less
+*		active current for the same behaviour: T16 and the IR carrier
+*		run from the IHRC itself and keep their timing (see the system
+*		clock below). LEDSCAN needs the full 4 MHz
+* BROADCAST	start with the pattern of broadcast[] in the pattern slot and
+*		hand it on to the other badges, for the one badge on the
+*		workshop table that carries a new pattern (see the pattern slot
+*		below)
+*/
+
+/*******************************************************************************
+* controllers: the Makefile passes DEVICE on (-DPFS154, or -DPMS154C with make
+* DEVICE=PMS154C) and checks the RAM and ROM of the build against the budget
+* of the part, see there.
+* PMS154C	OTP part, pin compatible with the PFS154-S16 and with the same
+*		2K words of ROM and 128 bytes of RAM: the cheaper part for
+*		badges that are programmed once
+* The PMS150C cannot drive the board: it only has port A (PA0, PA3..PA7), and
+* the charlieplexed LEDs need PB0..PB7 as well.
+*/
+#ifdef PMS150C
+#error "the PMS150C has no port B for the LEDs, use the PMS154C"
+#endif
+#define PATTERNSLOT			// see the pattern slot below
+#if defined(INSTRUMENT) || defined(TRACE)
+#define SERIALDUMP			// see housekeeping()
+#endif
+
 /*******************************************************************************
 * configure/calibrate system clock source
+* The system clock is the IHRC divided by IHRC_HZ/F_CPU. Calibrating the
+* system clock to F_CPU calibrates the IHRC to IHRC_HZ, whatever the divider,
+* and T16 and TM2 are clocked from the IHRC: their settings below are derived
+* from IHRC_HZ and do not change with F_CPU. The CPU only needs a fraction of
+* 4MHz between the interrupts; the LED scan engine is the exception, with an
+* interrupt every 128 us.
 */
+#define IHRC_HZ		16000000
+
+#ifndef F_CPU
+#define F_CPU		4000000
+#endif
+#if F_CPU == 4000000
+#define SYSCLOCK	SYSCLOCK_IHRC_4MHZ
+#elif F_CPU == 2000000
+#define SYSCLOCK	SYSCLOCK_IHRC_2MHZ
+#elif F_CPU == 1000000
+#define SYSCLOCK	SYSCLOCK_IHRC_1MHZ
+#else
+#error "F_CPU must be 4000000, 2000000 or 1000000"
+#endif
+#if defined(LEDSCAN) && F_CPU < 4000000
+#error "the LED scan engine needs F_CPU 4000000"
+#endif
+
 unsigned char _sdcc_external_startup(void)
 {
-	// use the IHRC oscillator, target 4MHz
-	PDK_SET_SYSCLOCK(SYSCLOCK_IHRC_4MHZ);
-	// calibrate for 4MHz operation @ 4000 mVolt
-	EASY_PDK_CALIBRATE_IHRC(4000000,4000);
+	// use the IHRC oscillator, divided down to F_CPU
+	PDK_SET_SYSCLOCK(SYSCLOCK);
+	// calibrate for F_CPU operation @ 4000 mVolt
+	EASY_PDK_CALIBRATE_IHRC(F_CPU,4000);
 	return 0;   // keep SDCC happy
 }
 
 
 /*******************************************************************************
-* provide arduino-like millis() functionality using T16
+* millisecond timebase using T16
 * T16 can be clocked from several sources, use a clock divider and can generate
 * an interruput when a certain bit (8..15) changes.
-* We assume the IHRC is calibrated to 16MHz, then dividing by 64 will produce
-* a 250 KHz input clock to T16. After 256 clock pulses bit 8 will toggle, which
-* is almost once a millisecond. To make it exactly once a millisecond, we should
-* load T16 (which is an up-counter) with the value 6.
+* T16 is clocked from the IHRC oscillator itself, not from the system clock,
+* so it runs at the same rate for every F_CPU. The divider follows from
+* IHRC_HZ and T16_HZ: 16 gives a 1MHz input clock to T16.
+*
+* T16 is never written, it runs freely and bit 8 goes high every 512 counts,
+* every 512 us (bit 9 every 1024 us with BATTERYSAVER, to wake up half as
+* often). Reloading it in the interrupt would lose the counts that pass before
+* the reload (the interrupt entry latency), which made every tick a few us too
+* long. Instead the interrupt adds t16step to an error accumulator, t16acc,
+* and counts a tick every time that reaches TICK_UNITS. The accumulator counts
+* in 1/16 us (1/32 us with LEDSCAN), so TICK_UNITS is one millisecond and
+* T16_UNITS is one T16 interrupt period. With t16step at T16_UNITS the ticks
+* are exactly 1000 us on average, with no systematic error (0 ppm) on top of
+* the IHRC calibration error. A single tick may come up to one T16 period
+* early or late. With BATTERYSAVER the period is longer than a tick, so some
+* interrupts count two ticks.
+*
+* Changing t16step by one unit changes the tick rate by 1/T16_UNITS, 122 ppm
+* (244 ppm with LEDSCAN, 61 ppm with BATTERYSAVER). The cooperative badge uses
+* that to follow the clock of the group, see learndrift().
+*
+* The interrupt counts milliseconds in the 16 bit tickcount, which wraps every
+* 65.5 seconds. All timing is done on differences between two tick values,
+* which unsigned arithmetic keeps correct across the wrap as long as the
+* interval itself is shorter than the wrap period:
+* ticks() returns the full 16 bit count. That takes two byte reads, so it reads
+*   until it gets the same value twice instead of masking the interrupt.
+* ticks8() returns just the low byte, a single (atomic) read. That is all the
+*   hot paths need, as they only measure intervals well below 256 ms.
+* elapsed() and elapsed8() return the wrap-safe number of ticks since <t>.
 */
-volatile uint32_t elapsedmillis;  // overflows after 49.71 days
+volatile uint16_t tickcount;
 
-void setup_millis() {
-	T16M = (uint8_t)(T16M_CLK_IHRC | T16M_CLK_DIV64 | T16M_INTSRC_8BIT);
-	T16C=6;
-	elapsedmillis=0;
+uint16_t ticks() {
+	uint16_t current;
+	do {
+		current = tickcount;
+	} while (current != tickcount);
+	return(current);
+}
+
+#define ticks8()	(*(volatile uint8_t *)&tickcount)	// little endian
+#define elapsed(t)	((uint16_t)(ticks() - (t)))
+#define elapsed8(t)	((uint8_t)(ticks8() - (uint8_t)(t)))
+
+#ifdef LEDSCAN
+// the scan engine needs a faster interrupt: divide by 4 for 4MHz, bit 8 then
+// goes high every 128 us
+#define TICK_UNITS	32000		// 1 ms in 1/32 us
+#define T16_UNITS	4096		// 128 us between T16 interrupts
+#define T16_HZ		4000000		// T16C counting rate
+#define T16_PERIOD	512		// T16C counts between T16 interrupts
+#define IR_UNIT_IRQS	8		// T16 interrupts per IR unit (1024 us)
+#elif defined(BATTERYSAVER)
+#define TICK_UNITS	16000		// 1 ms in 1/16 us
+#define T16_UNITS	16384		// 1024 us between T16 interrupts
+#define T16_HZ		1000000		// T16C counting rate
+#define T16_PERIOD	1024		// T16C counts between T16 interrupts
+#define IR_UNIT_IRQS	1		// T16 interrupts per IR unit (1024 us)
+#else
+#define TICK_UNITS	16000		// 1 ms in 1/16 us
+#define T16_UNITS	8192		// 512 us between T16 interrupts
+#define T16_HZ		1000000		// T16C counting rate
+#define T16_PERIOD	512		// T16C counts between T16 interrupts
+#define IR_UNIT_IRQS	2		// T16 interrupts per IR unit (1024 us)
+#endif
+
+#if IHRC_HZ / T16_HZ == 4
+#define T16M_DIV	T16M_CLK_DIV4
+#elif IHRC_HZ / T16_HZ == 16
+#define T16M_DIV	T16M_CLK_DIV16
+#elif IHRC_HZ / T16_HZ == 64
+#define T16M_DIV	T16M_CLK_DIV64
+#else
+#error "T16_HZ is not the IHRC divided by 4, 16 or 64"
+#endif
+#if T16_PERIOD == 512
+#define T16M_TICK	(T16M_CLK_IHRC | T16M_DIV | T16M_INTSRC_8BIT)
+#elif T16_PERIOD == 1024
+#define T16M_TICK	(T16M_CLK_IHRC | T16M_DIV | T16M_INTSRC_9BIT)
+#else
+#error "T16_PERIOD must be 512 or 1024"
+#endif
+
+uint16_t t16acc;		// time since the last tick, in TICK_UNITS/ms
+uint16_t t16step;		// added to t16acc every T16 interrupt
+
+void setup_ticks() {
+	T16M = (uint8_t)(T16M_TICK);
+	t16acc=0;
+	t16step=T16_UNITS;
+	tickcount=0;
 	INTEN |= INTEN_T16;
 }
 
 /*******************************************************************************
-* Interrupt dispatcher - only T16 is used
+* sincetick() returns the time since the last tick in TICK_UNITS, at T16C
+* <t16>: t16acc plus the T16C counts since the last T16 interrupt. That can be
+* more than a tick, when a T16 interrupt is due (BATTERYSAVER, or one that is
+* pending), so it is only called with the interrupts off. The counts are taken
+* at the nominal rate, so the time steps back by up to the drift correction
+* (see learndrift()) at the next interrupt, 15 us at most.
 */
-void interrupt(void) __interrupt(0) {
-	if (INTRQ & INTRQ_T16) {
-		INTRQ &= ~INTRQ_T16; // Mark as processed
-		elapsedmillis++;
-		T16C=6;
+uint16_t sincetick(uint16_t t16) {
+	uint16_t counts = (t16 - T16_PERIOD/2) & (T16_PERIOD - 1);
+	uint16_t since = t16acc + counts * (T16_UNITS / T16_PERIOD);
+
+	// a T16 interrupt that is due but not handled yet has wrapped counts
+	if ((INTRQ & INTRQ_T16) && counts < T16_PERIOD/2) since += T16_UNITS;
+	return(since);
+}
+
+/*******************************************************************************
+* idle() puts the core in power-save mode (STOPEXE) until something happens.
+* Unlike STOPSYS, STOPEXE only stops the CPU: the IHRC keeps running, so T16
+* keeps counting and TM2 keeps generating the IR carrier. The core wakes up on
+* the next T16 interrupt (every 512 us, 128 us with LEDSCAN, 1024 us with
+* BATTERYSAVER) or on a level change of a pin that has its digital input
+* enabled in PADIER/PBDIER, which is only the sync input PA4 (see setup()).
+* Interrupts, including the comparator interrupt that catches the sync edge,
+* are serviced right after wake-up.
+*
+* A wake-up event that arrives between the last check and the STOPEXE is
+* picked up one T16 tick later at most. patterntask() schedules from the previous
+* deadline, so this never accumulates into the step timing.
+*/
+#define idle() __stopexe()
+
+/*******************************************************************************
+* Fine time: finetime() is T16C itself, which counts the T16_HZ clock freely
+* (see above): a timestamp in 1 us units (0.25 us with LEDSCAN), read in one
+* go by the core, from main or from the interrupt. The 16 bits wrap every
+* 65.5 ms (16.4 ms with LEDSCAN), so like ticks8() it is for intervals well
+* below that. It runs at the nominal IHRC rate, without the drift correction
+* of the ticks, which does not matter over such short times. Steps and
+* everything else in the sequence keep counting in ticks.
+* finedue(t) tells whether fine time <t> has come, a single compare that is
+* cheap enough to poll, as serialbyte() does. waitfine() waits for it, see
+* there.
+*/
+#define finetime()	((uint16_t)T16C)
+#define finedue(t)	((int16_t)(finetime() - (t)) >= 0)
+
+/*******************************************************************************
+* waitfine() waits until fine time <t> (see finetime()), for timing finer than
+* a tick without a faster T16 interrupt: it sleeps through the interrupts as
+* long as more than a T16 period is left, as idle() wakes up at the next one
+* at the latest, and polls T16C for the rest. That is the only busy part, at
+* most one T16 period. <t> must lie less than half the wrap of T16C ahead.
+*/
+void waitfine(uint16_t t) {
+	while ((int16_t)(t - finetime()) > T16_PERIOD) idle();
+	while (!finedue(t));
+}
+
+/*******************************************************************************
+* Instrumentation (INSTRUMENT build option). Small counters that only ever go
+* up: maxima of how long things take, and counts of events that should be
+* rare. The durations are in T16 counts (1 us, 0.25 us with LEDSCAN) and all
+* counters saturate at 255.
+*
+* They are made visible in two ways, both on the programming header:
+* - PA6 is high while the interrupt dispatcher runs, so a scope or logic
+*   analyzer shows the interrupt latency, duration and rate directly
+* - in the middle of every cycle the counters are sent on PA5 as 0xa5 followed
+*   by the bytes of stats, 9600 baud 8N1. PA5 is driven open drain (low or
+*   released, with its latch kept at 0, see driveleds()), its pull-up is
+*   enabled in setup(), so a 3.3V USB serial adapter can read it
+* The dump takes about 8 ms, which may delay the step that is due meanwhile;
+* patterntask() schedules from the previous deadline, so it does not drift.
+* Without INSTRUMENT all of this compiles to nothing. The serial output is
+* shared with TRACE.
+*/
+#define SERIAL_PIN	0x20		// PA5, counter and trace dumps
+
+#ifdef SERIALDUMP
+#define SERIAL_BIT	(T16_HZ / 9600)	// T16 counts (fine units) per bit
+
+void serialbyte(uint8_t c) {
+	uint16_t frame = (uint16_t)c << 1 | 0x200;	// start, 8 data, stop
+	uint16_t t = finetime();
+	for (uint8_t i=0; i<10; i++) {
+		if (frame & 1) PAC &= ~SERIAL_PIN; else PAC |= SERIAL_PIN;
+		frame >>= 1;
+		t += SERIAL_BIT;
+		while (!finedue(t));	// deadline based, no drift
 	}
 }
+#endif
+
+#ifdef INSTRUMENT
+typedef struct {
+	uint8_t isrlatency;	// max from the T16 interrupt to the dispatcher
+	uint8_t isrtime;	// max time spent in the dispatcher
+	uint8_t setledtime;	// max time spent in setled()
+	uint8_t overshoot;	// max ms that a step ended late
+	uint8_t late;		// steps that ended late, see patterntask()
+	uint8_t muted;		// receiver edges ignored while transmitting
+	uint8_t overrun;	// frames before the previous one was handled
+	uint8_t jams;		// carriers too long to be a frame, see JAM_TIME
+} stats_t;
+
+stats_t stats;
+
+#define MARK_PIN	0x40		// PA6, high while in the dispatcher
+
+#define stat_max(f,v)	do { uint8_t v_ = (v); if (v_ > stats.f) stats.f = v_; } while (0)
+#define stat_count(f)	do { if (stats.f != 255) stats.f++; } while (0)
+#define stat_start()	uint16_t stat_t0 = T16C
+#define stat_stop(f)	stat_max(f, stat_sat(T16C - stat_t0))
+#define stat_late(n)	do { uint8_t n_ = (n); if (n_) { stat_count(late); stat_max(overshoot, n_); } } while (0)
+#define stat_dump()	statdump()
+#define mark_on()	(PA = (PA & ~PA_LOW) | MARK_PIN)	// see driveleds()
+#define mark_off()	(PA &= ~(MARK_PIN | PA_LOW))
+
+uint8_t stat_sat(uint16_t v) {
+	return v > 255 ? 255 : (uint8_t)v;
+}
+
+void statdump(void) {
+	serialbyte(0xa5);
+	for (uint8_t i=0; i<sizeof(stats); i++) serialbyte(((uint8_t *)&stats)[i]);
+}
+#else
+#define stat_max(f,v)	do { } while (0)
+#define stat_count(f)	do { } while (0)
+#define stat_start()
+#define stat_stop(f)	do { } while (0)
+#define stat_late(n)	do { } while (0)
+#define stat_dump()	do { } while (0)
+#define mark_on()	do { } while (0)
+#define mark_off()	do { } while (0)
+#endif
+
+/*******************************************************************************
+* Sync trace (TRACE build option). When a group falls apart in the field, the
+* question is whether frames were missed, broken up or crowded out. With
+* TRACE the last TRACE_EVENTS sync events are kept in a ring buffer, two bytes
+* each: the low byte of tickcount when it happened (the difference between
+* two events is the time between them, modulo 256 ms) and the event, its type
+* in bits 7:5 and a detail in bits 4:0:
+* TRACE_FRAME	a frame was received; 0 a sync frame, 1 a join request, 2 an
+*		old style 25 ms pulse, 3 a pattern chunk
+* TRACE_BROKEN	a frame broke off at symbol 2*detail of the frame (0 = in the
+*		leader, n = in bit n-1, clipped to 30), 31 = complete but
+*		not ours or failing the check byte
+* TRACE_SEND	our frame went on the air
+* TRACE_DROP	our queued frame was given up; 0 someone else started first,
+*		1 the channel was busy when the backoff ran out
+* TRACE_JAM	1 a jammer was detected, 0 it is gone
+* TRACE_RESET	a frame reset the sequence, detail = the state it was in
+* TRACE_COUPLE	a frame nudged the phase, detail = the error in 16 ms units,
+*		signed, clipped to -16..15
+*
+* trace() costs a few instructions (two stores and an increment), so it can
+* be called on the hot paths of the interrupt without disturbing the timing
+* it records. The main program uses tracemain(), which keeps the interrupt
+* out while it writes. In the middle of every sequence housekeeping() sends
+* the buffer on PA5 like the counter dump (see above): 0x5a followed by the
+* events, oldest first, entries that were never used are 0xff 0xff; events
+* that happen while it is sent (17 ms) may take the place of the oldest ones.
+* Without TRACE all of this compiles to nothing.
+*/
+#define TRACE_FRAME	0x00
+#define TRACE_BROKEN	0x20
+#define TRACE_SEND	0x40
+#define TRACE_DROP	0x60
+#define TRACE_JAM	0x80
+#define TRACE_RESET	0xa0
+#define TRACE_COUPLE	0xc0
+#define TRACE_CHECK	31		// TRACE_BROKEN detail of a complete frame
+#define TRACE_EMPTY	0xff		// time and event of an unused entry
+
+#ifdef TRACE
+#ifndef TRACE_EVENTS
+#define TRACE_EVENTS	8		// a power of 2
+#endif
+#define TRACE_MASK	(2*TRACE_EVENTS - 1)
+
+uint8_t tracebuf[2*TRACE_EVENTS];	// time, event; time, event; ...
+uint8_t tracepos;			// where the next event goes
+
+#define trace(e)	do { uint8_t p_ = tracepos; tracebuf[p_] = ticks8(); \
+				tracebuf[p_+1] = (e); tracepos = (p_ + 2) & TRACE_MASK; } while (0)
+#define tracemain(e)	do { __disgint(); trace(e); __engint(); } while (0)
+#define tracebroken(symbol)	trace(TRACE_BROKEN | ((symbol) < 60 ? (symbol) >> 1 : 30))
+#define trace_dump()	tracedump()
+
+void tracedump(void) {
+	uint8_t start = tracepos;
+	serialbyte(0x5a);
+	for (uint8_t i=0; i<2*TRACE_EVENTS; i++)
+		serialbyte(tracebuf[(uint8_t)(start + i) & TRACE_MASK]);
+}
+#else
+#define trace(e)	do { } while (0)
+#define tracemain(e)	do { } while (0)
+#define tracebroken(symbol)	do { } while (0)
+#define trace_dump()	do { } while (0)
+#endif
 
 /*******************************************************************************
-* 32 bit operations are non-atomic on this 8 bit microcontroller, so we must
-* disable the T16 interrupt and then re-enable it after reading the value
+* The IR receiver output on PA4 is normally high and goes low while it receives
+* a modulated 38 kHz signal. PA4 is not one of the pin-change interrupt sources
+* (PA0 and PB0), but it can be selected as the plus input of the comparator,
+* and the comparator does raise an interrupt whenever its output changes. The
+* minus input is the internal resistor ladder, set to about half VDD:
+* GPCC [7] = 1 -> enable comparator
+* GPCC [6] -> result, 1 when the plus input (PA4) is above the minus input
+* GPCC [4] = 0 -> do not invert
+* GPCC [3:1]=011 -> minus input is Vinternal R
+* GPCC [0] = 1 -> plus input is PA4
+* GPCS [7] = 0 -> do not output the result on PA0 (that is an LED pin)
+* GPCS [5:4]=00 -> case 1, Vinternal R = VDD/4 + n*VDD/32
+* GPCS [3:0]=1000 -> n=8, VDD/2
+*
+* Badges sync with short coded frames, NEC style: a leader (carrier for 8
+* units, then 4 units of silence) and 32 bits, each a mark of 1 unit followed
+* by a space of 1 (a 0) or 3 units (a 1), least significant bit first, ended
+* by a stop mark. The bits are FRAME_ID (the badge group and the sequence
+* running, so badges only sync with badges playing the same sequence), the
+* phase of the sender at the start of the frame in ms (16 bits) and a check
+* byte, ~(byte0 ^ byte1 ^ byte2). A unit is 1024 us, a whole number of T16
+* interrupts in every build, so the T16 interrupt times every edge exactly
+* (see sendunit()). A frame takes 80-140 ms, well within the one second the
+* README allows.
+*
+* A pattern chunk is a frame of the same format with CHUNK_ID | n instead of
+* FRAME_ID, n = 0..SLOT_RUNS, and 16 bits of a pattern instead of the phase.
+* Only badges with a pattern slot send and take them (see the pattern slot
+* below); receiveedge() latches the data in chunkdata and 1 + n in
+* chunkflag for slottask(). They share the group with the sync frames but not
+* the sequence: bit 3 of the first byte tells them apart, so SEQUENCE_ID stays
+* below 8.
+*
+* The comparator interrupt decodes the frames, see receiveedge(). It times
+* marks and spaces with T16C and takes the time of the frame in ticks at the
+* START of the leader: that edge does not depend on the length of a pulse or
+* on the receiver's release time. leaderstart() takes the receiver's attack
+* time (RX_LATENCY) and the sender's mean lag behind its own tick off it. A
+* valid frame latches its start in synctime and its phase in syncphase and
+* sets syncflag, which rxtask() reads and clears. The bare 25 ms carrier
+* burst of older badges is still accepted, as a frame with phase 0 that
+* starts where the burst starts.
+*
+* Sending does not block the LED sequence: sendframe() only queues the frame
+* and the T16 interrupt does the rest. The receiver on this badge also sees
+* (the reflection of) its own frame, so edges are ignored while rxmute counts
+* down, from the start of the frame until SYNC_ECHO ms after its end. So
+* sending and receiving never overlap, and share framebits.
+*
+* Listen before talk: badges that reach the end of their sequence together
+* would all send at once, so a queued frame first waits a random backoff of
+* txbackoff ms. Any mark that the receiver sees in the meantime means some
+* other badge is already sending a frame, and ours is dropped; so is a frame
+* that would start while the channel is busy (a frame being received, or a
+* carrier on PA4). Only two badges that pick backoffs within the receiver
+* delay of each other still collide. The frame carries the backoff as its
+* phase, so receivers are not thrown off by it. The random numbers come from
+* an 8 bit LFSR that every received edge stirs with T16C, which runs
+* independently of the clock of the sender.
+*
+* A carrier that stays on for JAM_TIME ms is no frame: the longest mark is
+* the 25 ms old style pulse. That is a jammer, such as an antisocial badge
+* (spamIR()), or a lamp that modulates near 38 kHz. The badge then stops
+* listening and runs free: the comparator interrupt is ignored, so the
+* dropouts a receiver shows (its AGC) during a long carrier neither cost time
+* nor look like frames. A frame being received or queued is dropped, and
+* none is sent, as the channel is busy. tick() watches PA4 meanwhile and
+* starts listening again once the carrier has been gone for JAM_RELEASE ms.
+*
+* A badge that is switched on asks for the phase of the group instead of
+* waiting for the next frame, which may be minutes away: it sends a join
+* request, a frame with JOIN_PHASE (never a real phase) in the phase field,
+* and listens for up to JOIN_WINDOW ms, see join(). receivedframe() sets
+* joinflag for a request, and txtask() answers it with a frame that
+* carries the current phase. Every badge in range answers, so the answers go
+* through a longer backoff, ANSWER_BACKOFF ms: then in a crowd the first one
+* still cancels all the others, where in BACKOFF_MAX ms two of them often
+* picked the same millisecond. A badge also listens for JOIN_LISTEN ms before
+* it asks, so when many are switched on together most of them take the
+* answer to an earlier request.
 */
-uint32_t millis() {
-	INTEN &= ~INTEN_T16;
-	uint32_t current = elapsedmillis;
-	INTEN |= INTEN_T16;
-	return(current);
+#define SYNC_PULSE	25		// ms, length of an old style sync pulse
+#define SYNC_SLACK	5		// ms, tolerance on that length
+#define SYNC_ECHO	2		// ms, receiver delay after our own frame
+#define GPCC_SYNC	0b10000111	// comparator on, PA4 vs. Vinternal R
+#define GPCS_SYNC	0b00001000	// Vinternal R = VDD/2
+#define GPCC_RESULT	0x40		// comparator output bit in GPCC
+#define CARRIER_ON	0b00101000	// TM2C: IHRC, output on PA3, see sendframe()
+#define IR_PIN		0x08		// PA3, the IR LED, see driveleds()
+#define PA_LOW		(IR_PIN | SERIAL_PIN)	// PA latches that stay 0
+#define CARRIER_HZ	38000		// the receiver's centre frequency
+#define CARRIER_TOLERANCE 2		// %, well inside its band pass
+#define TM2_BOUND	((IHRC_HZ + CARRIER_HZ) / (2*CARRIER_HZ) - 1)	// TM2B
+
+#if TM2_BOUND > 255
+#error "the IR carrier needs the TM2 prescaler at this IHRC_HZ"
+#endif
+#if (2*(TM2_BOUND+1)*CARRIER_HZ - IHRC_HZ) * 100 > CARRIER_TOLERANCE * IHRC_HZ \
+		|| (IHRC_HZ - 2*(TM2_BOUND+1)*CARRIER_HZ) * 100 > CARRIER_TOLERANCE * IHRC_HZ
+#error "the IR carrier is more than CARRIER_TOLERANCE off CARRIER_HZ"
+#endif
+
+#ifndef BADGE_GROUP
+#define BADGE_GROUP	0
+#endif
+#define SEQUENCE_ID	2		// change when SEQUENCE() changes
+#define FRAME_ID	(BADGE_GROUP << 4 | SEQUENCE_ID)
+#define CHUNK_ID	(BADGE_GROUP << 4 | 0x08)	// | chunk number
+#define SLOT_RUNS	4		// runs in the pattern slot, one per chunk
+
+#if BADGE_GROUP < 0 || BADGE_GROUP > 15
+#error "BADGE_GROUP must be 0..15, the high nibble of FRAME_ID"
+#endif
+#if SEQUENCE_ID < 0 || SEQUENCE_ID > 7
+#error "SEQUENCE_ID must be 0..7, the low nibble of FRAME_ID below CHUNK_ID"
+#endif
+
+#define IR_UNIT		((uint16_t)T16_PERIOD * IR_UNIT_IRQS)	// T16C counts
+#define LEADER_MARK	8		// units
+#define LEADER_SPACE	4
+#define ZERO_SPACE	1
+#define ONE_SPACE	3
+#define FRAME_BITS	32
+#define FRAME_SYMBOLS	(2 + 2*FRAME_BITS + 1)	// leader, bits, stop mark
+#define RX_TIMEOUT	12		// ms without an edge that ends a frame
+#define JAM_TIME	200		// ms of carrier that make a jammer
+#define JAM_RELEASE	20		// ms without carrier that end it
+#define JOIN_PHASE	0xffff		// the phase field of a join request
+#define BACKOFF_MAX	64		// ms, a power of 2, see sendframe()
+#define ANSWER_BACKOFF	128		// ms, a power of 2, for join answers
+#define RX_LATENCY	250		// us from the carrier to the receiver output
+#define RX_OFFSET	(RX_LATENCY * (TICK_UNITS/1000) + T16_UNITS/2)
+
+volatile uint8_t syncflag;		// set when a frame was received
+volatile uint16_t synctime;		// tickcount at the start of that frame
+volatile uint16_t syncphase;		// and the phase it carried
+volatile uint8_t joinflag;		// set when a join request was received
+volatile uint8_t rxmute;		// ms left to ignore the receiver
+#ifdef PATTERNSLOT
+volatile uint8_t chunkflag;		// 1 + the number of a chunk received
+volatile uint16_t chunkdata;		// and its data
+#endif
+
+uint32_t framebits;			// bits still to be sent, or received so far
+uint8_t txsymbol;			// mark or space being sent
+volatile uint8_t txunits;		// units left of it, 0 when not sending
+uint8_t txsub;				// T16 interrupts left of the unit
+volatile uint8_t txbackoff;		// ms until the queued frame starts
+uint8_t lfsr = 1;			// random numbers, never 0
+
+uint8_t rxsymbol;			// 1 + the symbol being received, 0 = idle
+uint8_t rxtimeout;			// ms left before the frame is abandoned
+uint16_t rxedge;			// T16C at the previous edge
+uint16_t rxstart;			// tickcount at the start of the leader
+uint8_t rxactive;			// ms of carrier, or of silence when jammed
+volatile uint8_t jammed;		// set while the receiver is ignored
+
+void setup_sync() {
+	GPCS = GPCS_SYNC;
+	GPCC = GPCC_SYNC;
+	syncflag = 0;
+	joinflag = 0;
+#ifdef PATTERNSLOT
+	chunkflag = 0;
+#endif
+	txunits = 0;
+	txbackoff = 0;
+	rxsymbol = 0;
+	rxmute = 0;
+	rxactive = 0;
+	jammed = 0;
+	INTEN |= INTEN_COMP;
+}
+
+#define channelbusy()	(rxsymbol != 0 || !(GPCC & GPCC_RESULT))
+#define syncbusy()	(txbackoff != 0 || txunits != 0)	// a frame of ours
+
+/*******************************************************************************
+* random8() steps the LFSR (x^8 + x^6 + x^5 + x^4 + 1) and returns it
+*/
+uint8_t random8(void) {
+	uint8_t lsb = lfsr & 1;
+
+	lfsr >>= 1;
+	if (lsb) lfsr ^= 0xb8;
+	if (!lfsr) lfsr = 1;
+	return(lfsr);
+}
+
+/*******************************************************************************
+* startframe() starts the leader of the queued frame, the carrier is
+* described at sendframe()
+*/
+void startframe(void) {
+	rxmute = 255; // ignore our own frame, sendunit() shortens this at its end
+	txsymbol = 0;
+	txsub = IR_UNIT_IRQS;
+	TM2C=0; // stop
+	TM2CT=0;
+	TM2B=TM2_BOUND;
+	TM2S=0; // clear the counter
+	TM2C=CARRIER_ON; // go
+	txunits = LEADER_MARK; // set after starting, the interrupt takes over
+	trace(TRACE_SEND);
+}
+
+/*******************************************************************************
+* tick() is called by the interrupt dispatcher once every millisecond
+*/
+void tick(void) {
+	tickcount++;
+	if (rxmute) rxmute--;
+	if (rxtimeout && --rxtimeout == 0) {
+		if (rxsymbol) tracebroken(rxsymbol - 1);
+		rxsymbol = 0;
+	}
+	if (txbackoff && --txbackoff == 0) {
+		if (!channelbusy()) startframe();
+		else trace(TRACE_DROP | 1);
+	}
+	if (!jammed) {
+		if (GPCC & GPCC_RESULT) {
+			rxactive = 0;
+		} else if (++rxactive == JAM_TIME) {
+			jammed = 1; // see the IR section
+			trace(TRACE_JAM | 1);
+			rxactive = 0;
+			rxsymbol = 0;
+			txbackoff = 0;
+			stat_count(jams);
+		}
+	} else if (!(GPCC & GPCC_RESULT)) {
+		rxactive = 0;
+	} else if (++rxactive == JAM_RELEASE) {
+		INTRQ &= ~INTRQ_COMP; // forget the edges of the jammer
+		jammed = 0;
+		trace(TRACE_JAM | 0);
+		rxactive = 0;
+	}
+}
+
+/*******************************************************************************
+* sendunit() is called by the T16 interrupt at the end of every unit of a frame
+* that is being sent. Even symbols are marks (carrier on), odd ones spaces.
+*/
+void sendunit(void) {
+	if (--txunits) return;
+	if (++txsymbol == FRAME_SYMBOLS) {
+		TM2C = 0; // stop PWM, PA3 falls back to its PA latch
+		PA &= ~PA_LOW; // make sure IR LED is off
+		rxmute = SYNC_ECHO;
+		return;
+	}
+	if (txsymbol & 1) {
+		TM2C = 0;
+		PA &= ~PA_LOW;
+		if (txsymbol == 1) {
+			txunits = LEADER_SPACE;
+		} else {
+			txunits = ((uint8_t)framebits & 1) ? ONE_SPACE : ZERO_SPACE;
+			framebits >>= 1;
+		}
+	} else {
+		TM2C = CARRIER_ON;
+		txunits = 1;
+	}
+}
+
+/*******************************************************************************
+* receiveedge() is called by the comparator interrupt on every edge of the
+* receiver output, <high> after the end of a mark. rxsymbol follows the symbol
+* numbering of sendunit(), plus one. Anything that does not fit the frame
+* format abandons the frame, and a mark that starts then may be a new leader.
+*/
+void receivedframe(uint16_t phase) {
+	if (phase == JOIN_PHASE) {
+		joinflag = 1;
+		return;
+	}
+	if (syncflag) stat_count(overrun);
+	synctime = rxstart;
+	syncphase = phase;
+	syncflag = 1;
+}
+
+/*******************************************************************************
+* leaderstart() gives the tickcount at which the carrier of a leader mark
+* started, for a receiver edge at T16C <t16>. The sender starts the leader on
+* a T16 interrupt, at a random point of its tick, half a T16 period after the
+* tick on average; the receiver shows the mark RX_LATENCY later. Both are
+* taken off the time since our own tick (sincetick()), and the result is
+* rounded to the nearest tick, so the receivers line up with the sender within
+* a fraction of a millisecond instead of lagging up to a tick behind it.
+*/
+uint16_t leaderstart(uint16_t t16) {
+	uint16_t since = sincetick(t16) + TICK_UNITS/2;
+	uint16_t start = tickcount - 1;
+
+	if (since < RX_OFFSET) return(start);
+	since -= RX_OFFSET;
+	start++;
+	while (since >= TICK_UNITS) {
+		since -= TICK_UNITS;
+		start++;
+	}
+	return(start);
+}
+
+void receiveedge(uint8_t high) {
+	uint16_t now = T16C;
+	uint16_t length = now - rxedge;	// of the mark or space that just ended
+	uint8_t symbol = rxsymbol - 1;
+
+	rxedge = now;
+	rxtimeout = RX_TIMEOUT;
+	lfsr ^= (uint8_t)now;
+	if (rxmute) {
+		if (high) stat_count(muted);
+		rxsymbol = 0;
+		return;
+	}
+	if (rxsymbol == 0 || high == (symbol & 1)) {
+		// idle, or an edge was missed
+	} else if (symbol == 0) {
+		uint8_t ms = (uint8_t)(tickcount - rxstart);
+		if (ms >= SYNC_PULSE - SYNC_SLACK && ms <= SYNC_PULSE + SYNC_SLACK) {
+			trace(TRACE_FRAME | 2);
+			receivedframe(0); // an old style sync pulse
+			symbol = FRAME_SYMBOLS; // taken, for the trace below
+		} else if (length >= 6*IR_UNIT && length < 10*IR_UNIT) {
+			rxsymbol++;
+			return;
+		}
+	} else if (symbol == 1) {
+		if (length >= 3*IR_UNIT && length < 5*IR_UNIT) {
+			rxsymbol++;
+			return;
+		}
+	} else if (!high) {
+		// the space of a bit
+		if (length >= IR_UNIT/2 && length < 4*IR_UNIT) {
+			framebits >>= 1;
+			if (length >= 2*IR_UNIT) framebits |= 0x80000000;
+			rxsymbol++;
+			return;
+		}
+	} else if (length >= IR_UNIT/2 && length < 2*IR_UNIT) {
+		// a mark, the last one is the stop mark
+		if (symbol < FRAME_SYMBOLS - 1) {
+			rxsymbol++;
+			return;
+		}
+		uint8_t *b = (uint8_t *)&framebits; // little endian
+		if (b[3] != (uint8_t)~(b[0] ^ b[1] ^ b[2])) {
+			trace(TRACE_BROKEN | TRACE_CHECK);
+		} else if (b[0] == FRAME_ID) {
+			trace(TRACE_FRAME | ((b[1] & b[2]) == 0xff)); // join request
+			receivedframe(b[1] | (uint16_t)b[2] << 8);
+#ifdef PATTERNSLOT
+		} else if ((uint8_t)(b[0] - CHUNK_ID) <= SLOT_RUNS) {
+			trace(TRACE_FRAME | 3);
+			chunkdata = b[1] | (uint16_t)b[2] << 8;
+			chunkflag = 1 + b[0] - CHUNK_ID;
+#endif
+		} else {
+			trace(TRACE_BROKEN | TRACE_CHECK);
+		}
+		symbol = FRAME_SYMBOLS; // taken
+	}
+	if (rxsymbol && symbol < FRAME_SYMBOLS) tracebroken(symbol);
+	rxsymbol = 0;
+	if (!high) {
+		// a mark starts, maybe the leader of a new frame
+		if (txbackoff) trace(TRACE_DROP | 0);
+		txbackoff = 0; // and someone else is talking, drop ours
+		joinflag = 0; // and answer nobody
+		rxstart = leaderstart(now);
+		rxtimeout = SYNC_PULSE + SYNC_SLACK + 1;
+		rxsymbol = 1;
+	}
+}
+
+#ifdef LEDSCAN
+void scanleds(void);		// see the LED scan engine below
+#else
+void gateleds(void);		// see setled() below
+#endif
+
+/*******************************************************************************
+* Interrupt dispatcher - T16 and the comparator (sync input) are used
+*/
+void interrupt(void) __interrupt(0) {
+	stat_start();
+	mark_on();
+	if (INTRQ & INTRQ_T16) {
+		// T16 interrupts when its bit rises, halfway through a period
+		stat_max(isrlatency, stat_sat((T16C - T16_PERIOD/2) & (T16_PERIOD-1)));
+		INTRQ &= ~INTRQ_T16; // Mark as processed
+#ifdef LEDSCAN
+		scanleds();
+#else
+		gateleds();
+#endif
+		if (txunits && --txsub == 0) {
+			txsub = IR_UNIT_IRQS;
+			sendunit();
+		}
+		t16acc += t16step;
+		while (t16acc >= TICK_UNITS) {
+			t16acc -= TICK_UNITS;
+			tick();
+		}
+	}
+	if (INTRQ & INTRQ_COMP) {
+		INTRQ &= ~INTRQ_COMP; // Mark as processed
+		if (!jammed) receiveedge((GPCC & GPCC_RESULT) ? 1 : 0);
+	}
+	mark_off();
+	stat_stop(isrtime);
 }
 
 
@@ -77,7 +832,8 @@ uint32_t millis() {
 * well as implement intermediate brightness levels, but one has to take into
 * account a lot more details - individual pin drive strength, charlieplexing
 * level (20x) and the speed (~20 frames/s) necessary to make persistence of
-* vision work, and this is outside the (KISS) scope of this project
+* vision work, and this is outside the (KISS) scope of this project. Builds
+* with the LEDSCAN option do exactly that anyway, see the LED scan engine.
 *
 * When viewed on the PCB, in this file the LEDs are numbered as follows: 
 *
@@ -140,69 +896,588 @@ uint32_t millis() {
  
  
 /*******************************************************************************
-* this function takes the number of the LED on the left and right sides that
+* setled() uses one lookup table per side. For every LED the table holds the
+* pins that must be driven (the direction bits for PAC and PBC) and which of
+* those must be driven high (the level bits for PA and PB). Entry LED_OFF has
+* no pins driven, which switches that side off.
+*
+* Only the pins belonging to one side are ever touched (PA7 and PB4..PB7 on
+* the left, PA0 and PB0..PB3 on the right), so the IR pins PA3/PA4 and the
+* other side are left alone.
+*/
+#define LED_OFF		20		// index that switches a side off
+
+#define LEFT_PA		0x80		// PA7
+#define LEFT_PB		0xf0		// PB4..PB7
+#define RIGHT_PA	0x01		// PA0
+#define RIGHT_PB	0x0f		// PB0..PB3
+
+typedef struct {
+	uint8_t pac;			// PA pins driven
+	uint8_t pa;			// PA pins driven high
+	uint8_t pbc;			// PB pins driven
+	uint8_t pb;			// PB pins driven high
+} ledpins_t;
+
+const ledpins_t leftpins[LED_OFF+1] = {
+	{ 0x80, 0x00, 0x10, 0x10 },	// L00
+	{ 0x00, 0x00, 0x90, 0x10 },	// L01
+	{ 0x00, 0x00, 0x50, 0x10 },	// L02
+	{ 0x00, 0x00, 0x30, 0x10 },	// L03
+	{ 0x80, 0x00, 0x20, 0x20 },	// L04
+	{ 0x00, 0x00, 0xa0, 0x20 },	// L05
+	{ 0x00, 0x00, 0x60, 0x20 },	// L06
+	{ 0x00, 0x00, 0x30, 0x20 },	// L07
+	{ 0x80, 0x00, 0x40, 0x40 },	// L08
+	{ 0x00, 0x00, 0xc0, 0x40 },	// L09
+	{ 0x00, 0x00, 0x60, 0x40 },	// L10
+	{ 0x00, 0x00, 0x50, 0x40 },	// L11
+	{ 0x80, 0x00, 0x80, 0x80 },	// L12
+	{ 0x00, 0x00, 0xc0, 0x80 },	// L13
+	{ 0x00, 0x00, 0xa0, 0x80 },	// L14
+	{ 0x00, 0x00, 0x90, 0x80 },	// L15
+	{ 0x80, 0x80, 0x80, 0x00 },	// L16
+	{ 0x80, 0x80, 0x40, 0x00 },	// L17
+	{ 0x80, 0x80, 0x20, 0x00 },	// L18
+	{ 0x80, 0x80, 0x10, 0x00 },	// L19
+	{ 0x00, 0x00, 0x00, 0x00 }	// LED_OFF
+};
+
+const ledpins_t rightpins[LED_OFF+1] = {
+	{ 0x01, 0x00, 0x08, 0x08 },	// R00
+	{ 0x00, 0x00, 0x09, 0x08 },	// R01
+	{ 0x00, 0x00, 0x0a, 0x08 },	// R02
+	{ 0x00, 0x00, 0x0c, 0x08 },	// R03
+	{ 0x01, 0x00, 0x04, 0x04 },	// R04
+	{ 0x00, 0x00, 0x05, 0x04 },	// R05
+	{ 0x00, 0x00, 0x06, 0x04 },	// R06
+	{ 0x00, 0x00, 0x0c, 0x04 },	// R07
+	{ 0x01, 0x00, 0x02, 0x02 },	// R08
+	{ 0x00, 0x00, 0x03, 0x02 },	// R09
+	{ 0x00, 0x00, 0x06, 0x02 },	// R10
+	{ 0x00, 0x00, 0x0a, 0x02 },	// R11
+	{ 0x01, 0x00, 0x01, 0x01 },	// R12
+	{ 0x00, 0x00, 0x03, 0x01 },	// R13
+	{ 0x00, 0x00, 0x05, 0x01 },	// R14
+	{ 0x00, 0x00, 0x09, 0x01 },	// R15
+	{ 0x01, 0x01, 0x01, 0x00 },	// R16
+	{ 0x01, 0x01, 0x02, 0x00 },	// R17
+	{ 0x01, 0x01, 0x04, 0x00 },	// R18
+	{ 0x01, 0x01, 0x08, 0x00 },	// R19
+	{ 0x00, 0x00, 0x00, 0x00 }	// LED_OFF
+};
+
+
+/*******************************************************************************
+* driveleds() takes the number of the LED on the left and right sides that
 * should be switched ON as arguments
-* if an argument is 20, then LEDs on the corresponding side are switched OFF
+* if an argument is 20 (LED_OFF), then LEDs on the corresponding side are
+* switched OFF
 * if an argument is >=21, then the corresponding side is left unchanged
+*
+* Every side is first released (all its pins HiZ), then the new levels are
+* written and only then the new pin pair is driven. The ports therefore never
+* pass through a state in which some other LED could light up.
+*
+* A read of PA returns the pin levels, and during a frame TM2 drives PA3 with
+* the carrier, while serialbyte() drives PA5 open drain: released, its
+* pull-up holds it high. So the read-modify-writes of PA here (and in the
+* interrupt, see mark_on()) always write 0 into the latches of PA_LOW.
+* Otherwise a high carrier cycle could end up in the PA3 latch, and the IR
+* LED would stay lit once TM2 stops, or a released PA5 in its own, which
+* would turn the next 1 bit of the dump into a driven high.
 */
-void setled(int8_t left,int8_t right)
+void driveleds(uint8_t left, uint8_t right)
 {
-	if ( left < 21 )
+	if ( left <= LED_OFF )
 	{
-		PAC &= 0x7f; PBC &= 0x0f; // disable all left outputs
-		switch (left)
-		{
-			case 0: PA &= 0x7f; PAC |= 0x80; PB |= 0x10; PBC |= 0x10; break;
-			case 1: PB &= 0x7f; PBC |= 0x80; PB |= 0x10; PBC |= 0x10; break;
-			case 2: PB &= 0xbf; PBC |= 0x40; PB |= 0x10; PBC |= 0x10; break;
-			case 3: PB &= 0xdf; PBC |= 0x20; PB |= 0x10; PBC |= 0x10; break;
-			case 4: PA &= 0x7f; PAC |= 0x80; PB |= 0x20; PBC |= 0x20; break;
-			case 5: PB &= 0x7f; PBC |= 0x80; PB |= 0x20; PBC |= 0x20; break;
-			case 6: PB &= 0xbf; PBC |= 0x40; PB |= 0x20; PBC |= 0x20; break;
-			case 7: PB &= 0xef; PBC |= 0x10; PB |= 0x20; PBC |= 0x20; break;
-			case 8: PA &= 0x7f; PAC |= 0x80; PB |= 0x40; PBC |= 0x40; break;
-			case 9: PB &= 0x7f; PBC |= 0x80; PB |= 0x40; PBC |= 0x40; break;
-			case 10: PB &= 0xdf; PBC |= 0x20; PB |= 0x40; PBC |= 0x40; break;
-			case 11: PB &= 0xef; PBC |= 0x10; PB |= 0x40; PBC |= 0x40; break;
-			case 12: PA &= 0x7f; PAC |= 0x80; PB |= 0x80; PBC |= 0x80; break;
-			case 13: PB &= 0xbf; PBC |= 0x40; PB |= 0x80; PBC |= 0x80; break;
-			case 14: PB &= 0xdf; PBC |= 0x20; PB |= 0x80; PBC |= 0x80; break;
-			case 15: PB &= 0xef; PBC |= 0x10; PB |= 0x80; PBC |= 0x80; break;
-			case 16: PB &= 0x7f; PBC |= 0x80; PA |= 0x80; PAC |= 0x80; break;
-			case 17: PB &= 0xbf; PBC |= 0x40; PA |= 0x80; PAC |= 0x80; break;
-			case 18: PB &= 0xdf; PBC |= 0x20; PA |= 0x80; PAC |= 0x80; break;
-			case 19: PB &= 0xef; PBC |= 0x10; PA |= 0x80; PAC |= 0x80; break;
-			default: break; // left side off
-		}
+		PAC &= ~LEFT_PA; PBC &= ~LEFT_PB; // disable all left outputs
+		PA = (PA & ~(LEFT_PA | PA_LOW)) | leftpins[left].pa;
+		PB = (PB & ~LEFT_PB) | leftpins[left].pb;
+		PAC |= leftpins[left].pac;
+		PBC |= leftpins[left].pbc;
 	}
-	if ( right < 21 )
+	if ( right <= LED_OFF )
 	{
-		PAC &= 0xfe; PBC &= 0xf0; // disable all right outputs		
-		switch (right)
-		{
-			case 0: PA &= 0xfe; PAC |= 0x01; PB |= 0x08; PBC |= 0x08; break;
-			case 1: PB &= 0xfe; PBC |= 0x01; PB |= 0x08; PBC |= 0x08; break;
-			case 2: PB &= 0xfd; PBC |= 0x02; PB |= 0x08; PBC |= 0x08; break;
-			case 3: PB &= 0xfb; PBC |= 0x04; PB |= 0x08; PBC |= 0x08; break;
-			case 4: PA &= 0xfe; PAC |= 0x01; PB |= 0x04; PBC |= 0x04; break;
-			case 5: PB &= 0xfe; PBC |= 0x01; PB |= 0x04; PBC |= 0x04; break;
-			case 6: PB &= 0xfd; PBC |= 0x02; PB |= 0x04; PBC |= 0x04; break;
-			case 7: PB &= 0xf7; PBC |= 0x08; PB |= 0x04; PBC |= 0x04; break;
-			case 8: PA &= 0xfe; PAC |= 0x01; PB |= 0x02; PBC |= 0x02; break;
-			case 9: PB &= 0xfe; PBC |= 0x01; PB |= 0x02; PBC |= 0x02; break;
-			case 10: PB &= 0xfb; PBC |= 0x04; PB |= 0x02; PBC |= 0x02; break;
-			case 11: PB &= 0xf7; PBC |= 0x08; PB |= 0x02; PBC |= 0x02; break;
-			case 12: PA &= 0xfe; PAC |= 0x01; PB |= 0x01; PBC |= 0x01; break;
-			case 13: PB &= 0xfd; PBC |= 0x02; PB |= 0x01; PBC |= 0x01; break;
-			case 14: PB &= 0xfb; PBC |= 0x04; PB |= 0x01; PBC |= 0x01; break;
-			case 15: PB &= 0xf7; PBC |= 0x08; PB |= 0x01; PBC |= 0x01; break;
-			case 16: PB &= 0xfe; PBC |= 0x01; PA |= 0x01; PAC |= 0x01; break;
-			case 17: PB &= 0xfd; PBC |= 0x02; PA |= 0x01; PAC |= 0x01; break;
-			case 18: PB &= 0xfb; PBC |= 0x04; PA |= 0x01; PAC |= 0x01; break;
-			case 19: PB &= 0xf7; PBC |= 0x08; PA |= 0x01; PAC |= 0x01; break;
-			default: break; // right side <off
+		PAC &= ~RIGHT_PA; PBC &= ~RIGHT_PB; // disable all right outputs
+		PA = (PA & ~(RIGHT_PA | PA_LOW)) | rightpins[right].pa;
+		PB = (PB & ~RIGHT_PB) | rightpins[right].pb;
+		PAC |= rightpins[right].pac;
+		PBC |= rightpins[right].pbc;
+	}
+}
+
+
+#ifdef LEDSCAN
+/*******************************************************************************
+* LED scan engine
+* With LEDSCAN the pattern code does not drive the ports itself. It writes the
+* brightness of the LEDs into a framebuffer, and the T16 interrupt multiplexes
+* all 40 LEDs from there. T16 then interrupts every 128 us and every interrupt
+* shows one phase: in phase n only L<n> and R<n> can be lit (the two sides use
+* separate pins, so they are driven at the same time). A frame of all 20
+* phases takes 2.56 ms, 390 frames/s.
+*
+* Every LED has a level from 0 (off) to LED_LEVELS (fully on), made by pulse
+* width modulation over LED_LEVELS frames: in frame f a LED is lit when its
+* level is above f, so with 3 levels the PWM period is 7.7 ms (130 Hz). A fully
+* on LED is lit during 1 of the 20 phases, which is a lot dimmer than a LED
+* that driveleds() drives all the time without LEDSCAN.
+*
+* framebuffer[n] holds the level of L<n> in the high and of R<n> in the low
+* nibble. The interrupt only reads it, one byte per phase, and the pattern code
+* only writes it, so there is no need to mask interrupts. Each interrupt does
+* the same fixed work: one framebuffer read, two compares and driveleds().
+*/
+#define LED_LEVELS	3		// brightness of a fully lit LED
+#ifdef BATTERYSAVER
+#define LED_ON		1		// level setled() lights a LED with
+#else
+#define LED_ON		LED_LEVELS
+#endif
+#define LED_DIM		1		// and on a weak battery, see checkpower()
+
+uint8_t framebuffer[LED_OFF];		// L<n> level << 4 | R<n> level
+uint8_t ledon = LED_ON;			// level that setled() uses
+uint8_t scanphase;			// phase shown by the last interrupt
+uint8_t scanframe;			// frame number within the PWM period
+
+#define setleft(n,level)	(framebuffer[n] = (framebuffer[n] & 0x0f) | ((level) << 4))
+#define setright(n,level)	(framebuffer[n] = (framebuffer[n] & 0xf0) | (level))
+
+void scanleds(void)
+{
+	if (++scanphase == LED_OFF)
+	{
+		scanphase = 0;
+		if (++scanframe == LED_LEVELS) scanframe = 0;
+	}
+	uint8_t levels = framebuffer[scanphase];
+	driveleds( (levels >> 4) > scanframe ? scanphase : LED_OFF,
+		   (levels & 0x0f) > scanframe ? scanphase : LED_OFF );
+}
+
+void setup_scan(void)
+{
+	for (uint8_t i=0; i<LED_OFF; i++) framebuffer[i] = 0;
+	scanphase = 0;
+	scanframe = 0;
+}
+
+
+/*******************************************************************************
+* setled() keeps the interface of driveleds() for the patterns: it lights the
+* LED on the left and right sides given as arguments in the framebuffer and
+* switches off all others, 20 (LED_OFF) switches a side off and >=21 leaves a
+* side unchanged. The LEDs get level ledon: LED_ON, fully on, or 1 of the
+* LED_LEVELS with BATTERYSAVER, a third of the LED current. On a weak
+* battery that drops to LED_DIM.
+*/
+void setled(uint8_t left, uint8_t right)
+{
+	for (uint8_t i=0; i<LED_OFF; i++)
+	{
+		if (left <= LED_OFF) setleft(i, i == left ? ledon : 0);
+		if (right <= LED_OFF) setright(i, i == right ? ledon : 0);
+	}
+}
+#else
+/*******************************************************************************
+* LED current is most of the power budget, so with BATTERYSAVER setled() does
+* not keep the LEDs on for the whole step: the T16 interrupt gates them, lit
+* during 1 of every LED_DUTY interrupts (1 ms in 4, 244 Hz, so it does not
+* flicker). The normal profile keeps them on (ledduty 0) until the battery
+* gets weak, and then gates them too, at LED_DIM. setled() takes the same
+* arguments as driveleds(), remembers the LEDs in ledleft and ledright for
+* gateleds(), and lights them immediately so every step still starts on
+* time. T16 is masked while it does that, as both change the same port
+* registers.
+*/
+#ifdef BATTERYSAVER
+#define LED_DUTY	4		// T16 interrupts per LED pulse
+#define LED_DIM		8		// and on a weak battery, 1 ms in 8
+#else
+#define LED_DUTY	0		// not gated
+#define LED_DIM		2		// on a weak battery, 512 us in 1024
+#endif
+
+uint8_t ledleft = LED_OFF;		// LEDs set by the last setled()
+uint8_t ledright = LED_OFF;
+uint8_t gatephase;			// T16 interrupts since the pulse started
+uint8_t ledduty = LED_DUTY;		// see checkpower()
+
+void gateleds(void)
+{
+	if (!ledduty) return;
+	if (++gatephase >= ledduty) gatephase = 0;
+	if (gatephase == 0) driveleds(ledleft, ledright);
+	else if (gatephase == 1) driveleds(LED_OFF, LED_OFF);
+}
+
+void setled(uint8_t left, uint8_t right)
+{
+	if (left <= LED_OFF) ledleft = left;
+	if (right <= LED_OFF) ledright = right;
+	INTEN &= ~INTEN_T16;
+	gatephase = 0;
+	driveleds(ledleft, ledright);
+	INTEN |= INTEN_T16;
+}
+#endif
+
+
+/*******************************************************************************
+* Power stages
+* As the battery runs down the LEDs dim unevenly, the IR range shrinks and
+* finally the core browns out. Instead the badge gives things up in stages,
+* the most expensive first, while it still works reliably:
+* stage	VDD below	n
+* 1	2.74 V		6	LEDs dimmed to LED_DIM (ledduty or ledon)
+* 2	2.56 V		7	frames sent at most half as often (endsequence())
+* 3	2.40 V		8	receive only: no frames, no join answers
+* 4	2.26 V		9	everything off and STOPSYS, see poweroff()
+* Stages only go up: the supply recovers a little whenever the load drops, and
+* a fresh battery restarts the badge anyway.
+*
+* The supply is measured with the comparator that otherwise watches the IR
+* receiver. lowsupply() switches it over for a moment, with the interrupts
+* masked (tick() and receiveedge() read its result): the plus input becomes
+* the resistor ladder and the minus input the 1.20 V bandgap, so the result is
+* 1 while VDD * (8 + n)/32 is above 1.20 V, VDD above 38.4 V / (8 + n):
+* GPCC [3:1]=010 -> minus input is the bandgap
+* GPCC [0] = 0 -> plus input is Vinternal R
+* GPCS [3:0] = POWER_LADDER + the current stage, the threshold of the next one
+* checkpower() does that once per sequence (36 s), when no frame is on the air
+* as the IR LED loads the battery most (see housekeeping()). A stage is taken
+* after POWER_CONFIRM readings below its threshold in a row.
+*/
+#define GPCC_SUPPLY	0b10000100	// comparator on, Vinternal R vs. bandgap
+#define POWER_LADDER	6		// n of the threshold of stage 1
+#define POWER_SETTLE	(T16_HZ / 50000)	// T16C counts, 20 us
+#define POWER_CONFIRM	2		// readings in a row below the threshold
+#define POWER_DIM	1		// the stages
+#define POWER_SPARSE	2
+#define POWER_MUTE	3
+#define POWER_OFF	4
+
+uint8_t power;				// the stage, 0 on a good battery
+uint8_t powerlow;			// readings in a row below the next stage
+
+void settle(void) {
+	uint16_t t = T16C;
+	while ((uint16_t)(T16C - t) < POWER_SETTLE);
+}
+
+uint8_t lowsupply(void) {
+	uint8_t low;
+
+	__disgint();
+	GPCS = POWER_LADDER + power;
+	GPCC = GPCC_SUPPLY;
+	settle();
+	low = !(GPCC & GPCC_RESULT);
+	GPCS = GPCS_SYNC;
+	GPCC = GPCC_SYNC;
+	settle();
+	INTRQ &= ~INTRQ_COMP; // switching is not an edge of the receiver
+	__engint();
+	return(low);
+}
+
+/*******************************************************************************
+* poweroff() stops the badge for good: the LEDs, the carrier and the comparator
+* are switched off and no pin can wake the core from STOPSYS, which also stops
+* the oscillators. Only a power-on reset (a new battery) starts it again.
+*/
+void poweroff(void) {
+	__disgint();
+	TM2C = 0;
+	PA &= ~PA_LOW; // make sure IR LED is off
+	driveleds(LED_OFF, LED_OFF);
+	GPCC = 0;
+	PADIER = 0;
+	PBDIER = 0;
+	while (1) __stopsys();
+}
+
+void checkpower(void) {
+	if (!lowsupply()) {
+		powerlow = 0;
+		return;
+	}
+	if (++powerlow < POWER_CONFIRM) return;
+	powerlow = 0;
+	power++;
+	if (power == POWER_DIM) {
+#ifdef LEDSCAN
+		ledon = LED_DIM;
+#else
+		ledduty = LED_DIM;
+#endif
+	}
+	if (power == POWER_OFF) poweroff();
+}
+
+
+/*******************************************************************************
+* Patterns are not hand-written functions but ROM data, played by patterntask().
+*
+* Every pattern is a list of "runs". A run takes RUN_STEPS steps, one for every
+* LED on a side (so a run on its own looks like a LED walking along one side).
+* For each side a run holds a "track" byte that tells which LED is lit at
+* step i of the run:
+* bit 7 = 1 -> count down from the start index (start-i), 0 -> up (start+i)
+* bit 6 = 1 -> look the index up in the LED table, 0 -> it is the LED itself
+* bits 5:0 -> start index (0..39 for the LED table, 0..19 for a LED)
+* A track that starts at LED_OFF and does not use the LED table keeps its
+* side off. Both sides mirrored, running opposite or independently are just
+* different combinations of the two track bytes.
+*
+* A pattern is a slice of consecutive runs plus the time of one step, packed
+* in two bytes by PATTERN(), and the sequence (see SEQUENCE()) plays every
+* pattern a number of times. Patterns may share
+* runs: twoledsflap is twoledsflapdown followed by twoledsflapup.
+*
+* The runs, the patterns and the sequence are not written here but in
+* patterns.txt: make turns that into patterns.h with the pattern compiler in
+* ../tools, which shares runs between patterns, checks every limit below and
+* reports the ROM and the time every pattern takes. Adding a pattern means
+* adding it there, not code.
+*/
+#define RUN_STEPS	20		// steps in a run, one per LED on a side
+
+#define TRACK_UP	0x00		// start+i
+#define TRACK_DOWN	0x80		// start-i
+#define TRACK_TABLE	0x40		// ledtable(start+i) or (start-i)
+#define TRACK_START	0x3f		// start index
+#define TRACK_OFF	(TRACK_UP | LED_OFF)	// side stays off
+
+typedef struct {
+	uint8_t left;			// track for the left side
+	uint8_t right;			// track for the right side
+} run_t;
+
+typedef struct {
+	uint8_t runs;			// first run << 3 | number of runs - 1
+	uint8_t steptime;		// milliseconds per step, 125 max, see startstep()
+} pattern_t;
+
+// <count> (1..8) runs starting at run <first> (0..31) of runs[]
+#define PATTERN(first,count,steptime)	{ (first) << 3 | ((count) - 1), (steptime) }
+
+/*******************************************************************************
+* ROM holds every constant byte as one instruction word (a RET k), so tables
+* are packed where that pays off. A LED index only needs 5 bits: PACK5() packs
+* 8 of them into 5 bytes, lowest bit first, and ledtable() extracts index <n>
+* again. That takes a few dozen cycles, nothing compared to a step, and works
+* the same for tracks counting up and down. ledsequence[] holds LEDTABLE_SIZE
+* indices (see patterns.txt), the 40 of the random patterns in 25 bytes
+* instead of 40. The bit position n*5 is computed in 8 bits, so a packed table
+* holds at most 51 indices.
+*/
+#define PACK5(a,b,c,d,e,f,g,h) \
+	(uint8_t)((a) | (b) << 5), (uint8_t)((b) >> 3 | (c) << 2 | (d) << 7), \
+	(uint8_t)((d) >> 1 | (e) << 4), (uint8_t)((e) >> 4 | (f) << 1 | (g) << 6), \
+	(uint8_t)((g) >> 2 | (h) << 3)
+
+#include "patterns.h"		// ledsequence[], runs[], PATTERNS(), SEQUENCE()
+
+uint8_t ledtable(uint8_t n)
+{
+	uint8_t bit = n * 5;
+	uint8_t byte = bit >> 3;
+	uint16_t bits = ledsequence[byte];
+
+	bit &= 7;
+	if (bit > 3) bits |= (uint16_t)ledsequence[byte+1] << 8; // straddles two bytes
+	return((bits >> bit) & 0x1f);
+}
+
+/*******************************************************************************
+* The patterns by name: first run, number of runs and ms per step. PATTERNS()
+* (from patterns.h) generates the names, patterns[], the length of one play of
+* every pattern in ticks, <name>_TICKS (an int, so at most 32767 ms), and its
+* number of runs, <name>_COUNT: the SLOT pattern must have SLOT_RUNS, which
+* slot_fits checks.
+*/
+#define PATTERN_NAME(name,first,count,steptime)		name,
+#define PATTERN_TICKS(name,first,count,steptime)	name##_TICKS = (count) * RUN_STEPS * (steptime),
+#define PATTERN_ENTRY(name,first,count,steptime)	PATTERN(first, count, steptime),
+#define PATTERN_COUNT(name,first,count,steptime)	name##_COUNT = (count),
+
+enum { PATTERNS(PATTERN_NAME) };
+enum { PATTERNS(PATTERN_TICKS) };
+enum { PATTERNS(PATTERN_COUNT) };
+const pattern_t patterns[] = { PATTERNS(PATTERN_ENTRY) };
+
+/*******************************************************************************
+* The sequence: the patterns in the order they are played, and how many times
+* each is played in a row. SEQUENCE() (from patterns.h) generates sequence[],
+* which patterntask() steps through, and SEQUENCE_TICKS, the exact length of
+* the whole sequence in ms that the phase coupling and the drift compensation
+* depend on. Phases are 16 bit, so it has to stay below JOIN_PHASE, which
+* sequence_fits checks. Change SEQUENCE_ID when the sequence changes.
+*/
+typedef struct {
+	uint8_t pattern;		// see PATTERNS()
+	uint8_t repeats;		// plays in a row
+} part_t;
+
+#define SEQUENCE_ENTRY(pattern,repeats)	{ (pattern), (repeats) },
+#define SEQUENCE_PART(pattern,repeats)	+ (uint32_t)(repeats) * pattern##_TICKS
+
+const part_t sequence[] = { SEQUENCE(SEQUENCE_ENTRY) };
+
+#define SEQUENCE_PARTS	(sizeof(sequence) / sizeof(sequence[0]))
+#define SEQUENCE_TICKS	((uint16_t)(0 SEQUENCE(SEQUENCE_PART)))	// 38000 ms
+
+typedef char sequence_fits[(0 SEQUENCE(SEQUENCE_PART)) < JOIN_PHASE ? 1 : -1];
+typedef char slot_fits[SLOT_COUNT == SLOT_RUNS ? 1 : -1];
+
+#ifdef PATTERNSLOT
+/*******************************************************************************
+* The pattern slot: new patterns without reflashing every badge. The SLOT part
+* of the sequence plays SLOT_RUNS runs from RAM, slot[], once a complete
+* pattern has arrived over IR, and the ROM runs of its PATTERNS() entry until
+* then. Its length is fixed, so badges with and without a pattern stay in
+* sync.
+*
+* A pattern travels as SLOT_RUNS + 1 chunks (see the IR frames): chunk n <
+* SLOT_RUNS holds the left and right track of run n, chunk SLOT_RUNS the
+* version of the pattern and the sum of the run bytes. slottask() stores every
+* chunk as it comes and ticks it off in slotmask, so a transfer that breaks
+* off simply goes on with the chunks that are still missing, in later cycles
+* or from other badges. Once all have come, the sum must match: otherwise
+* runs of two patterns got mixed up, and the runs are collected again. A
+* complete pattern only gives way to a newer version (the versions count up
+* and wrap around).
+*
+* A badge with a complete pattern sends a chunk, the next one every time (see
+* sendchunk()), in the middle of the sequence once no chunk was heard or sent
+* for more than CHUNK_CYCLES sequences (see patterntask()). The sync frames go
+* out at the end of the sequence, so the two never compete for the channel.
+* Like the sync frames, the first badge to send cancels the others (and the
+* odds of a crowd apply, see adapttx()), so a group carries one chunk every
+* CHUNK_CYCLES + 1 sequences at most, taking turns between all badges that
+* have the pattern: from a single badge the transfer takes SLOT_RUNS + 1 of
+* those, about a quarter of an hour, and less the more badges have it. A
+* chunk is skipped while the holdoff of an earlier frame runs (see
+* TX_HOLDOFF), so a badge that is busy syncing its group leaves the chunks to
+* the others. A weak battery stops the chunks at POWER_SPARSE.
+*
+* Table tracks of a received run must stay inside the LEDTABLE_SIZE entries
+* of the LED table for all of the run (see trackok()), ledtable() does not
+* check that.
+*/
+#define CHUNK_CYCLES	4		// sequences between chunks, at least
+#define SLOT_VERSION	(1 << SLOT_RUNS)		// slotmask bit of the version
+#define SLOT_FULL	(2*SLOT_VERSION - 1)		// slotmask when complete
+
+run_t slot[SLOT_RUNS];
+uint8_t slotmask;		// chunks received, one bit per chunk
+uint8_t slotversion;		// of the pattern in the slot
+uint8_t slotsum;		// sum of its run bytes, from its version chunk
+uint8_t slotplaying;		// the slot's part is playing from slot[]
+uint8_t chunkquiet;		// sequences since a chunk was heard or sent
+
+#ifdef BROADCAST
+#define BROADCAST_VERSION	1	// count up when broadcast[] changes
+
+const run_t broadcast[SLOT_RUNS] = {
+	{ TRACK_TABLE | TRACK_UP | 0, TRACK_TABLE | TRACK_DOWN | 39 },
+	{ TRACK_UP | 0, TRACK_UP | 0 },
+	{ TRACK_TABLE | TRACK_DOWN | 19, TRACK_TABLE | TRACK_UP | 20 },
+	{ TRACK_DOWN | 19, TRACK_DOWN | 19 }
+};
+
+typedef char broadcast_fits[LEDTABLE_SIZE >= 40 ? 1 : -1];	// table entries 0..39
+#endif
+
+uint8_t slotcheck(void) {
+	uint8_t *p = (uint8_t *)slot;
+	uint8_t sum = 0;
+
+	for (uint8_t i=0; i<sizeof(slot); i++) sum += p[i];
+	return(sum);
+}
+
+void setup_slot(void) {
+#ifdef BROADCAST
+	for (uint8_t i=0; i<SLOT_RUNS; i++) {
+		slot[i].left = broadcast[i].left;
+		slot[i].right = broadcast[i].right;
+	}
+	slotversion = BROADCAST_VERSION;
+	slotmask = SLOT_FULL;
+	slotsum = slotcheck();
+#else
+	slotmask = 0;
+	slotversion = 0;
+#endif
+	slotplaying = 0;
+	chunkquiet = 0;
+}
+
+uint8_t trackok(uint8_t track) {
+	uint8_t n = track & TRACK_START;
+
+	if (!(track & TRACK_TABLE)) return(1); // runs off LED_OFF, which is harmless
+	if (track & TRACK_DOWN) return(n >= RUN_STEPS - 1 && n < LEDTABLE_SIZE);
+	return(n <= LEDTABLE_SIZE - RUN_STEPS);
+}
+
+/*******************************************************************************
+* slottask() takes a chunk that the comparator interrupt latched, see
+* chunkflag.
+* returns 1 if there was a chunk
+*/
+uint8_t slottask(void)
+{
+	if (!chunkflag) return(0);
+	INTEN &= ~INTEN_COMP; // chunkdata is not read atomically
+	uint8_t n = chunkflag - 1;
+	uint8_t low = (uint8_t)chunkdata;
+	uint8_t high = chunkdata >> 8;
+	chunkflag = 0;
+	INTEN |= INTEN_COMP;
+	chunkquiet = 0;
+	if (n == SLOT_RUNS) {
+		if ((slotmask & SLOT_VERSION) && low == slotversion) return(1);
+		if (slotmask == SLOT_FULL) {
+			if ((int8_t)(low - slotversion) < 0) return(1); // older
+			slotmask = 0; // a newer pattern, from scratch
 		}
+		slotversion = low;
+		slotsum = high;
+	} else {
+		if (slotmask == SLOT_FULL || !trackok(low) || !trackok(high)) return(1);
+		slot[n].left = low;
+		slot[n].right = high;
 	}
+	slotmask |= 1 << n;
+	if (slotmask == SLOT_FULL && slotcheck() != slotsum) slotmask = SLOT_VERSION;
+	return(1);
+}
+#else
+#define slottask()	0
+#endif
+
+
+/*******************************************************************************
+* ledindex() returns the LED for step <i> of a track
+*/
+uint8_t ledindex(uint8_t track, uint8_t i)
+{
+	uint8_t n = track & TRACK_START;
+
+	if (track & TRACK_TABLE)
+	{
+		if (track & TRACK_DOWN) n -= i; else n += i;
+		return(ledtable(n));
+	}
+	if (n >= LED_OFF) return(LED_OFF);
+	if (track & TRACK_DOWN) return(n - i);
+	return(n + i);
 }
 
 
@@ -213,70 +1488,295 @@ void setled(int8_t left,int8_t right)
 * Every pattern consists of several "steps" 
 * During any step, at most 2 LEDs are lit.
 *
-* While playing the sequence in the main loop, the processor also needs to
-* detect the asynchronous sync pulse. It does this by POLLING the IR receiver
-* multiple times during EVERY step. If a low-to-high transition is detected on
-* the pin connected to the IR receiver, then this means that the END of a sync
-* pulse is detected (providing some immunity against antisocial badges). This
-* will then result in the pattern being terminated and the state being reset to
-* zero. KISS. It is probably also possible to deal with synchronization using
-* interrupts, which might actually be just as easy...
+* While playing the sequence, the processor also needs to detect asynchronous
+* sync frames. They are decoded by the comparator interrupt, which latches
+* their start and sets syncflag (a continuous carrier from an antisocial badge
+* is not a frame). With HARDSYNC this will then result in the pattern being
+* terminated and the state being reset to zero. Otherwise the badge only
+* nudges its phase towards the frame, see rxtask().
+*
+* Nothing in the main program waits: it is a handful of tasks that main()
+* runs to completion, see there. The pattern engine, patterntask(), cycles
+* through the states, one for every part of sequence[], and plays the pattern
+* of that part N times. Its position is kept in state, repeat, run and step,
+* so every call can do one step and return: start the next step once the
+* previous one has taken steptime ms.
+*
+* seqpos is the phase of the badge within the complete sequence: the nominal
+* number of ms of all steps played since the sequence started. A complete
+* sequence takes SEQUENCE_TICKS ms.
 *
-* The main program cycles through the states, calls the appropriate pattern
-* routine that repeats it pattern N times. At every step in a pattern the
-* waituntil() function is called to wait some time before proceeding to the
-* next step in the pattern. The IR receiver is checked in the waituntil()
-* function.
+* quiet counts the middles of the sequence passed since a frame was last heard
+* or sent, and endsequence() only sends when it is above TX_CYCLES. Counting
+* at the middle keeps a frame that arrives just before or just after the end
+* of our sequence in the same count. Our own frame already counts as one, so
+* a badge sends at most every TX_CYCLES sequences, 76 s, while a badge that
+* hears it waits one sequence more: it only sends when the frames stop. An answer to a join request (a phase
+* beyond BACKOFF_MAX, see join()) does not count: every badge in range hears
+* it, and holding them all back would leave the group a sequence longer
+* without the sync frame that it needs more than the answer's phase.
+*
+* How often a badge sends also follows what it hears, see adapttx(): a badge
+* that hears nothing between two of its own frames may be alone, and nobody
+* would need its frames. Every 4 such frames in a row it waits one sequence
+* longer, up to TX_CYCLES_MAX, and it goes back to TX_CYCLES once it hears a
+* frame again. (The badge that is ahead of a group hears nothing either, as
+* the others stay quiet, so growing slowly keeps it sending for a good while
+* before another one takes over.) In a crowd, the frames heard between two of
+* our own show how many badges share the channel, as each sends about one in
+* that many. Beyond TX_CROWD of them a chance to send is only taken with odds
+* of 1 in 2^txodds, so a few hundred badges do not all jump at the first quiet
+* sequence together. The channel load then stays about the same however many
+* badges take part. Small groups keep odds of 1: there the badge that is ahead
+* should be the one that sends, which converges fastest.
+*
+* Sync frames are not all a badge sends: it also answers join requests (see
+* join()) and hands on the pattern slot (see sendchunk()). To keep to the once
+* a minute of the README whatever the mix, every frame that queueframe()
+* takes holds off all the others for TX_HOLDOFF ms: txheld is set until then
+* (see txtask()), and a sync frame, an answer or a chunk that comes up
+* meanwhile is skipped, not postponed. Some other badge of the group sends it
+* instead, or this one the next time.
 */
+#define TX_HOLDOFF	60000		// ms after any frame of ours, see txtask()
+#define TX_CYCLES	2		// sequences between our frames, at least
+#define TX_CYCLES_MAX	8		// and when there is nobody around
+#define ALONE_SHIFT	2		// 4 unanswered frames add one sequence
+#define TX_CROWD	8		// frames heard per halving of the odds
+#define TX_ODDS_MAX	4		// send at 1 in 16 chances at the least
 
-uint8_t state;			// The state of the main loop
-uint32_t previoustime;          // The last time the LEDs were updated
-uint8_t previouspinstate;	// The last state of the IR receiver pin
+uint8_t state;			// part of the sequence playing, 1-based, 0 = none
+uint8_t repeat;			// play of that part's pattern
+uint8_t run;			// run of the pattern
+uint8_t step;			// step of the run
+uint8_t firstrun, lastrun;	// the runs of the pattern, first and one past
+uint8_t steplength;		// ms, nominal length of the pattern's steps
+uint8_t steptime;		// ms, of the current step, 0 = none is running
+uint16_t previoustime;          // The last time the LEDs were updated
+uint16_t seqpos;		// ms into the sequence when previoustime passed
+uint8_t quiet;			// sequence middles since a frame was heard or sent
+uint8_t alone;			// our frames in a row that nobody answered
+uint8_t txodds;			// we take 1 in 2^txodds chances to send
+uint8_t heard;			// frames heard since our last frame
+uint16_t lasttx;		// ticks() when we queued our last frame
+uint8_t txheld;			// less than TX_HOLDOFF ms since lasttx
+uint8_t powerdue;		// checkpower() is due, see housekeeping()
+#ifdef PATTERNSLOT
+uint8_t chunkdue;		// send a chunk of the pattern slot, see txtask()
+#endif
+#ifdef SERIALDUMP
+uint8_t dumpdue;		// the dumps on PA5 are due
+#endif
 
+#ifndef HARDSYNC
+/*******************************************************************************
+* Phase coupling
+* A frame carries the phase of its sender at the start of the frame, so at
+* that moment every receiving badge should be at that phase as well (the
+* backoff, badges send right after the end of their sequence). The difference
+* is the phase error: positive when the receiver is ahead, negative when it
+* lags behind.
+*
+* Instead of jumping to phase 0, the badge takes the whole error into
+* phaseadjust and works that off by making each following step at most
+* COUPLING_SLEW ms longer (when ahead) or shorter (when behind). The nudge per
+* frame is bounded by the error, the change per step is bounded by the slew,
+* so patterns never visibly jump, while a single frame still removes the
+* error: with a frame only every TX_CYCLES sequences or more, taking half of
+* it per frame left the group minutes to converge. Only an error beyond
+* COUPLING_WINDOW (a badge that was switched on or came into range far out of
+* phase) still resets the sequence to state 0, because slewing that away
+* would take minutes.
+*
+* A badge that heard a frame in its last TX_CYCLES sequences (see quiet) does
+* not transmit at the end of its sequence (see endsequence()). Only the badge
+* that is ahead of the group keeps transmitting, so the number of transmitters
+* drops as phases merge.
+*/
+#define COUPLING_SLEW	2		// ms, max. change of the length of a step
+#define COUPLING_WINDOW	2000		// ms, larger phase errors reset
+
+int16_t phaseadjust;		// ms still to be added to (or cut from) steps
+
+/*******************************************************************************
+* syncerror() returns the phase error for a frame that started at <pulsestart>
+* with the sender at phase <txphase>
+*/
+int16_t syncerror(uint16_t pulsestart, uint16_t txphase)
+{
+	// our phase at the start of the frame, <0 if it started before this step
+	int32_t phase = (int32_t)seqpos + (int16_t)(pulsestart - previoustime) - txphase;
+
+	while (phase < 0) phase += SEQUENCE_TICKS;
+	while (phase >= SEQUENCE_TICKS) phase -= SEQUENCE_TICKS;
+	if (phase >= SEQUENCE_TICKS/2) phase -= SEQUENCE_TICKS;
+	return((int16_t)phase);
+}
+#endif
+
+
+/*******************************************************************************
+* Drift compensation
+* The transmitting badge sends a frame every few sequences, and the start of
+* the sequence it is in (the start of the frame minus its phase) is a whole
+* number of sequences of SEQUENCE_TICKS of ITS ticks after that of the
+* previous frame. The time between the two counted in our own ticks therefore
+* shows how fast our clock runs compared to the transmitter: more ticks means
+* our clock is fast. learndrift() takes that rate error out of t16step (see
+* the timebase), so the local clock converges on the clock of the group and
+* the phase errors stop building up between frames. Then the fastest badge is
+* no longer always the one that reaches the end of the sequence first and
+* does all the transmitting. The first DRIFT_FIRST intervals are taken in
+* full, as the clock is still off by the whole IHRC calibration error; after
+* that only half of each, which averages out the jitter of the timestamps.
+*
+* A unit of t16step is 122 ppm (see the timebase), which leaves up to 60 ppm,
+* 2 ms per sequence, and that soon adds up with frames a few sequences apart.
+* So the correction is kept in drifttrim, in 1/DRIFT_FRACTION units, and
+* dithertrim() adds the fraction to t16step on that share of the steps.
+*
+* Only frames up to DRIFT_CYCLES sequences apart are used, the longest
+* interval of a badge on a weak battery (see checkpower()): pulseage counts
+* the ends of our own sequence since the last frame, so frames further apart
+* (some were missed) are ignored. The interval is taken as the whole number of
+* sequences that it is within DRIFT_WINDOW of, or ignored if there is none (a
+* different transmitter). That also works when the interval is longer than
+* the 16 bit tick wraps, as the difference is exact modulo 2^16. The total
+* correction is limited to DRIFT_MAX.
+*/
+#define DRIFT_WINDOW	(SEQUENCE_TICKS/50)	// ms, 2% of a sequence
+#define DRIFT_MAX	(T16_UNITS/32)	// max. correction of t16step, 3%
+#define DRIFT_CYCLES	(2*TX_CYCLES_MAX + 1)	// max. sequences between frames
+#define DRIFT_FIRST	2		// intervals taken in full
+#define DRIFT_SHIFT	3
+#define DRIFT_FRACTION	(1 << DRIFT_SHIFT)	// drifttrim units per t16step unit
+
+uint16_t lastpulse;		// sequence start of the previous frame
+uint8_t pulseage;		// sequence ends since lastpulse
+int16_t drifttrim;		// correction of t16step, 1/DRIFT_FRACTION units
+uint8_t driftfrac;		// fractions of drifttrim carried, see dithertrim()
+uint8_t driftcount;		// intervals taken, up to DRIFT_FIRST
 
 /*******************************************************************************
-* waituntil() waits for at most <time> milliseconds
-* returns 0 in case of a timeout (normal)
-* returns 1 in case of a sync pulse detection
+* dithertrim() sets t16step for the next step from drifttrim: the whole units,
+* plus one on the share of the steps that the fraction asks for
 */
-uint8_t waituntil(int16_t time)
+void dithertrim(void)
+{
+	uint16_t step = T16_UNITS + (drifttrim >> DRIFT_SHIFT);
+
+	driftfrac += drifttrim & (DRIFT_FRACTION - 1);
+	if (driftfrac >= DRIFT_FRACTION) {
+		driftfrac -= DRIFT_FRACTION;
+		step++;
+	}
+	INTEN &= ~INTEN_T16; // t16step is not written atomically
+	t16step = step;
+	INTEN |= INTEN_T16;
+}
+
+void learndrift(uint16_t seqstart)
 {
-	uint32_t currenttime = millis();
-	uint8_t currentpinstate = (PA >> 4) & 1;
+	uint16_t interval = seqstart - lastpulse;
+	uint8_t age = pulseage;
+	int16_t error;
+	uint8_t n;
 
-	while ((currenttime - previoustime < time) && ( currentpinstate==0 || previouspinstate==1 ))
-	{    
-		currenttime = millis();
-		previouspinstate=currentpinstate;
-		currentpinstate = (PA >> 4) & 1;
+	lastpulse = seqstart;
+	pulseage = 0;
+	if (age > DRIFT_CYCLES) return;
+	for (n = 1; ; n++) {
+		interval -= SEQUENCE_TICKS;
+		error = (int16_t)interval;
+		if (error <= DRIFT_WINDOW && error >= -DRIFT_WINDOW) break;
+		if (n == DRIFT_CYCLES) return;
 	}
-    
-	if (currentpinstate==1 && previouspinstate==0) // rising edge on sync pin 
+
+	// t16step * span / (span + error), in DRIFT_FRACTION units
+	int32_t span = (int32_t)n * SEQUENCE_TICKS;
+	int32_t change = (int32_t)T16_UNITS * DRIFT_FRACTION * error;
+	if (driftcount < DRIFT_FIRST) driftcount++;
+	else span <<= 1; // half the gain
+	change += (error > 0) ? span/2 : -span/2; // round
+	int16_t trim = drifttrim - (int16_t)(change / span);
+	if (trim > DRIFT_MAX * DRIFT_FRACTION) trim = DRIFT_MAX * DRIFT_FRACTION;
+	if (trim < -DRIFT_MAX * DRIFT_FRACTION) trim = -DRIFT_MAX * DRIFT_FRACTION;
+	drifttrim = trim; // dithertrim() applies it
+}
+
+
+/*******************************************************************************
+* rxtask() takes a frame that the comparator interrupt latched, see syncflag.
+* The sender's sequence started at the START of the frame minus its phase;
+* that is what the drift is learned from and what a reset lines the sequence
+* up with. Without HARDSYNC a frame within COUPLING_WINDOW of our phase only
+* adds to phaseadjust, and the step just continues. A reset abandons the
+* current step and timestamps the next one from the sender's sequence start,
+* so the first steps come right away (see startstep()) until the badge has
+* caught up with the phase of the frame.
+* returns 1 if there was a frame
+*/
+uint8_t rxtask(void)
+{
+	if (!syncflag) return(0);
+	INTEN &= ~INTEN_COMP; // synctime is not read atomically
+	uint16_t pulsestart = synctime;
+	uint16_t txphase = syncphase;
+	syncflag=0;
+	INTEN |= INTEN_COMP;
+	learndrift(pulsestart - txphase);
+	if (txphase <= BACKOFF_MAX) quiet = 0; // not for answers, see quiet
+	if (heard < 255) heard++;
+#ifndef HARDSYNC
+	int16_t error = syncerror(pulsestart, txphase);
+	if (error <= COUPLING_WINDOW && error >= -COUPLING_WINDOW)
 	{
-		state=0;
-		previoustime=currenttime;
-		previouspinstate=1;
+		phaseadjust = error;
+		tracemain(TRACE_COUPLE | ((error > 255 ? 15 : error < -256 ? -16 : error >> 4) & 0x1f));
 		return(1);
 	}
-	else // timeout
-	{
-		previoustime += time;
-		return(0);
-	}   
+	phaseadjust = 0;
+#endif
+	tracemain(TRACE_RESET | state);
+	previoustime=pulsestart - txphase;
+	seqpos=0;
+	state=0;
+	steptime=0;
+	return(1);
 }
 
 
 /*******************************************************************************
-* to synchronize badges we want to transmit a 25 ms long 38 kHz synchronization
-* pulse using the IR LED. We want to do this at the end of a complete sequence.
-* Due to variation in clock speed some badges will reach the end of sequence
-* first, transmit a pulse, and thereby resetting the sequence of all other
-* badges in its range, and thereby also preventing any other badge in range
-* from transmitting a synchronization pulse.
+* adapttx() sets alone and txodds from the frames heard since our last
+* frame, see quiet. It is called whenever we send.
+*/
+void adapttx(void)
+{
+	if (!heard) {
+		if (alone < (TX_CYCLES_MAX - TX_CYCLES) << ALONE_SHIFT) alone++;
+		txodds = 0;
+	} else {
+		alone = 0;
+		if (heard > (TX_CROWD << txodds) && txodds < TX_ODDS_MAX) txodds++;
+		else if (txodds && heard < (TX_CROWD/4 << txodds)) txodds--;
+	}
+	heard = 0;
+}
+
+
+/*******************************************************************************
+* to synchronize badges we want to transmit a sync frame (see the IR frames at
+* the top) using the IR LED. We want to do this at the end of a complete
+* sequence. Due to variation in clock speed some badges will reach the end of
+* sequence first, transmit a frame, and thereby resetting the sequence of all
+* other badges in its range, and thereby also preventing any other badge in
+* range from transmitting a frame.
 * This is KISS synchronization.
 *
-* we want to generate a <time> ms long 38kHz sync pulse on PA3 using timer 2
-* IHRC 16MHz, 16000000/422=37.914 KHz
+* The marks of the frame are a 38kHz carrier on PA3 from timer 2 in period
+* mode, which counts 0..TM2B and toggles the output at every wrap (the period
+* mode formula of the PFS154 datasheet): IHRC_HZ/(2*(TM2_BOUND+1)),
+* 16000000/422=37.915 KHz, checked against CARRIER_HZ at compile time
 * TM2C [7:4]=0010 -> select IHRC
 * TB2C [3:2]=10 -> output on PA3 (00=disable)
 * TM2C [1] = 0 -> period mode
@@ -284,23 +1784,139 @@ uint8_t waituntil(int16_t time)
 * TM2S [7] = 0 -> 8 bit resolution
 * TM2S [6:5]=00 -> prescaler 1
 * TM2S [4:0]=00000 -> scaler 1
-* TM2B [7:0] -> 211
+* TM2B [7:0] -> TM2_BOUND, 210
+*
+* sendframe() is called at the end of the sequence with phase 0, or to answer
+* a join request with the current phase. It only queues the frame and returns
+* right away: after a random backoff of 1..<backoff> ms (BACKOFF_MAX, or
+* ANSWER_BACKOFF for an answer, powers of 2 up to 128) the T16 interrupt
+* starts it (see startframe()) and sends the rest, so the LED sequence keeps
+* playing. The frame carries the phase at its start, so the backoff is added.
+* A badge that resets on a frame at the end of the sequence restarts from the
+* start of the sender's sequence, which it notices up to BACKOFF_MAX + 140 ms
+* (the frame) later. Up to 128 ms + one step of that are caught up by playing
+* the first steps short, and beyond that startstep() skips the steps that are
+* over (see skipahead()), so the delay has no bound to keep: at worst the
+* steps of the first BACKOFF_MAX + 140 ms are not shown.
+* A join request (JOIN_PHASE) goes through the same backoff.
+* syncbusy() tells whether a frame is still queued or being sent.
 */
-void syncpulse(int16_t time)
+void queueframe(uint8_t id, uint16_t data, uint8_t delay)
+{
+    framebits = id | (uint32_t)data << 8
+             | (uint32_t)(uint8_t)~(id ^ (uint8_t)data ^ (uint8_t)(data >> 8)) << 24;
+    txbackoff = delay; // set last, the interrupt takes over
+    lasttx = ticks(); // see TX_HOLDOFF
+    txheld = 1;
+}
+
+void sendframe(uint16_t phase, uint8_t backoff)
 {
-    TM2C=0; // stop
-    TM2CT=0;
-    TM2B=211;
-    TM2S=0; // clear the counter
-    TM2C=0b00101000; // go
-    uint32_t currenttime = millis();
-    previoustime=currenttime;
-    while (currenttime - previoustime < time)
-    {
-    	currenttime = millis();
-    }   
-    TM2C=0; // stop PWM
-    PA=0; // make sure IR LED is off
+    uint8_t delay = 1 + (random8() & (backoff - 1));
+
+    if (phase != JOIN_PHASE) {
+        phase += delay;
+        if (phase >= SEQUENCE_TICKS) phase -= SEQUENCE_TICKS;
+    }
+    queueframe(FRAME_ID, phase, delay);
+}
+
+#ifdef PATTERNSLOT
+/*******************************************************************************
+* sendchunk() queues chunk txchunk of the pattern slot (see there) like
+* sendframe() does a sync frame, and moves txchunk on to the next one
+*/
+uint8_t txchunk;		// the chunk to send next
+
+void sendchunk(void)
+{
+	uint8_t n = txchunk;
+	uint16_t data = slotversion | (uint16_t)slotsum << 8;
+
+	if (n < SLOT_RUNS) data = slot[n].left | (uint16_t)slot[n].right << 8;
+	txchunk = n == SLOT_RUNS ? 0 : n + 1;
+	chunkquiet = 0;
+	queueframe(CHUNK_ID | n, data, 1 + (random8() & (BACKOFF_MAX - 1)));
+}
+#endif
+
+/*******************************************************************************
+* join() is called at the end of setup(): it listens for JOIN_LISTEN ms, and
+* unless some frame came in meanwhile it sends a join request (see the IR
+* frames at the top) and listens for up to JOIN_WINDOW ms. An answer is taken
+* like any other frame, except that the sequence starts where the sequence of
+* the sender started, in the past: skipahead() skips the steps that are
+* already over, so the badge picks up at the group's current point instead of
+* at state 1. Without an answer the sequence just starts now.
+* Badges that hear a request answer from txtask() with their current phase
+* once the channel is free, unless another badge starts answering first (see
+* receiveedge()).
+*/
+#define JOIN_LISTEN	2000		// ms, before the request
+#define JOIN_WINDOW	1000		// ms, answers take about 400 ms
+
+void join(void)
+{
+	uint16_t start = ticks();
+	uint16_t seqstart;
+	uint8_t answered;
+
+	while (!syncflag && elapsed(start) < JOIN_LISTEN) idle();
+	if (!syncflag) {
+		sendframe(JOIN_PHASE, BACKOFF_MAX);
+		start = ticks();
+		while (!syncflag && elapsed(start) < JOIN_WINDOW) idle();
+	}
+	INTEN &= ~INTEN_COMP; // synctime is not read atomically
+	seqstart = synctime - syncphase;
+	answered = syncflag;
+	syncflag = 0;
+	joinflag = 0;
+	INTEN |= INTEN_COMP;
+	if (answered) {
+		learndrift(seqstart);
+		quiet = 0;
+		previoustime = seqstart;
+	} else {
+		previoustime = ticks();
+	}
+}
+
+
+/*******************************************************************************
+* txtask() hands the frames the other tasks ask for to sendframe(): the sync
+* frame that endsequence() decided on (txsync), the chunk of the pattern slot
+* that patterntask() decided on (chunkdue, see sendchunk()), and the answer to
+* a join request once the channel is free. On a weak battery requests are not
+* answered, see checkpower().
+* returns 1 if it did any
+*/
+uint8_t txsync;			// send a sync frame, see endsequence()
+
+uint8_t txtask(void)
+{
+	if (txheld && elapsed(lasttx) >= TX_HOLDOFF) txheld = 0; // long before it wraps
+	if (txsync) {
+		txsync = 0;
+		adapttx();
+		sendframe(0, BACKOFF_MAX);
+		quiet = 1;
+		return(1);
+	}
+#ifdef PATTERNSLOT
+	if (chunkdue && !syncbusy() && !channelbusy()) {
+		chunkdue = 0;
+		if (!txheld) sendchunk();
+		return(1);
+	}
+#endif
+	if (joinflag && !syncbusy() && !channelbusy()) {
+		joinflag = 0;
+		if (power < POWER_MUTE && !txheld)
+			sendframe(seqpos + elapsed8(previoustime), ANSWER_BACKOFF);
+		return(1);
+	}
+	return(0);
 }
 
 
@@ -315,6 +1931,10 @@ void setup() { // Arduino-like setup function called once after power on
   	// PA1 and PA2 are not available on the package
   	PAPH = 0x76;
 	PBPH = 0x00;
+	// only PA4 (sync input) needs its digital input, which also makes it the
+	// only pin that wakes the core from idle()
+	PADIER = 0x10;
+	PBDIER = 0x00;
   	// set registers low
   	PA=0x00;
   	PB=0x00;
@@ -322,182 +1942,276 @@ void setup() { // Arduino-like setup function called once after power on
 	// IR LED is active high source/sink on the PA3 pin - set only PA3 as output
 	PAC=0x08;
 	PBC=0x00;
+#ifdef INSTRUMENT
+	PAC |= MARK_PIN; // PA5 stays an input with pull-up until it sends a 0
+#endif
   
-	setup_millis();
+	setup_ticks();
+#ifdef LEDSCAN
+	setup_scan();
+#endif
+#ifdef TRACE
+	for (uint8_t i=0; i<2*TRACE_EVENTS; i++) tracebuf[i] = TRACE_EMPTY;
+	tracepos = 0;
+#endif
+	setup_sync();
+#ifdef PATTERNSLOT
+	setup_slot();
+	txchunk=0;
+	chunkdue=0;
+#endif
 
 	INTRQ = 0;
 	__engint();                     // Enable global interrupts
-	previoustime=millis();
-	previouspinstate=1;
+	seqpos=0;
 	state=0;
+	steptime=0;
+	txsync=0;
+	powerdue=0;
+#ifdef SERIALDUMP
+	dumpdue=0;
+#endif
+	pulseage=255; // no previous frame
+	drifttrim=0;
+	driftfrac=0;
+	driftcount=0;
+	quiet=TX_CYCLES;
+	alone=0;
+	txodds=0;
+	heard=1; // there is no previous frame to judge by
+	txheld=0;
+	power=0;
+	powerlow=0;
+#ifndef HARDSYNC
+	phaseadjust=0;
+#endif
+	join(); // sets previoustime
 }
 
 
 /*******************************************************************************
-* individual pattern functions - with the number of repeats as a parameter
-* singleledccw		singleledcw
-* twoledsccw		twoledscw 
-* twoledsflapdown	twoledsflapup 
-* twoledsflap		twoledsrandom 
+* endsequence() is called between the last step of the sequence and the first
+* one of the next, a moment that not every badge reaches (see rxtask()). It
+* decides whether to send a sync frame, which txtask() does right after, and
+* leaves the rest to housekeeping().
 */
-void singleledccw(uint8_t n)
+void endsequence(void)
 {
-  	for (uint8_t r=0; r<n; r++)
-	{
-		for (int8_t i=0; i<20; i++)
-		{
-			setled(i,20);
-                        if (waituntil(25)) {return; }
-		}
-		for (int8_t i=0; i<20; i++)
-		{
-			setled(20,19-i);
-			if (waituntil(25)) {return; }
-		}
-	}
+	// stay quiet if some other badge is already ahead of us
+	uint8_t interval = TX_CYCLES + (alone >> ALONE_SHIFT);
+	if (power >= POWER_SPARSE) interval <<= 1;
+	if (power < POWER_MUTE && quiet > interval && !txheld && !syncbusy()
+			&& !channelbusy() && !(random8() & ((1 << txodds) - 1)))
+		txsync = 1;
+	if (pulseage < 255) pulseage++;
+	powerdue = 1;
+	seqpos=0;
+	state=0;
 }
 
-void singleledcw(uint8_t n)
+/*******************************************************************************
+* nextstep() moves the position on to the next step of the sequence, into the
+* first part after a reset (state 0), where startpart() sets up the pattern of
+* the part. returns 0 at the end of the sequence.
+*/
+void startpart(void)
 {
-  	for (uint8_t r=0; r<n; r++)
-	{
-		for (int8_t i=0; i<20; i++)
-		{
-			setled(20,i);
-			if (waituntil(25)) {return; }
-		}
-		for (int8_t i=0; i<20; i++)
-		{
-			setled(19-i,20);
-			if (waituntil(25)) {return; }
-		}
-	}
+	uint8_t pattern = sequence[state++].pattern;
+#ifdef PATTERNSLOT
+	slotplaying = pattern == SLOT && slotmask == SLOT_FULL;
+#endif
+	firstrun = patterns[pattern].runs >> 3;
+	lastrun = firstrun + (patterns[pattern].runs & 7) + 1;
+	steplength = patterns[pattern].steptime;
+	run = firstrun;
+	repeat = 0;
+	step = 0;
 }
 
-void twoledsccw(uint8_t n)
+uint8_t nextstep(void)
 {
-  	for (uint8_t r=0; r<n; r++)
-	{
-		for (int8_t i=0; i<20; i++)
-		{
-			setled(i,19-i);
-			if (waituntil(25)) {return; }
-		}
+	if (state) {
+		if (++step < RUN_STEPS) return(1);
+		step = 0;
+		if (++run < lastrun) return(1);
+		run = firstrun;
+		if (++repeat < sequence[state-1].repeats) return(1);
+		if (state == SEQUENCE_PARTS) return(0);
 	}
+	startpart();
+	return(1);
 }
 
-void twoledscw(uint8_t n)
+/*******************************************************************************
+* skipahead() moves the position on to the step that is playing now, for a
+* sequence that started long ago (after join() or a reset, see startstep()).
+* It starts over from the top of the sequence, through endsequence() if that
+* is over as well, and skips whole parts, plays, runs and steps as long as
+* they are over, all in one call: a few hundred additions at most, instead of
+* one call of patterntask() per step (1520 for a sequence of 25 ms steps)
+* while the other tasks wait. The lengths are added up, pdk14 has no multiply.
+*/
+void skipahead(void)
 {
-  	for (uint8_t r=0; r<n; r++)
-	{
-		for (int8_t i=0; i<20; i++)
-		{
-			setled(19-i,i);
-			if (waituntil(25)) {return; }
-		}
-	}
-}
+	uint16_t target = elapsed(previoustime);
+	uint16_t pos = 0;
+	uint16_t runticks, playticks, partticks;
+	uint8_t i;
 
-void twoledsflapdown(uint8_t n)
-{
-  	for (uint8_t r=0; r<n; r++)
-	{
-		for (int8_t i=0; i<20; i++)
-		{
-			setled(i,i);
-			if (waituntil(25)) {return; }
-		}
+	previoustime -= seqpos; // the start of the sequence
+	while (target >= SEQUENCE_TICKS - seqpos) {
+		previoustime += SEQUENCE_TICKS;
+		target -= SEQUENCE_TICKS - seqpos;
+		endsequence(); // seqpos = 0
 	}
-}
-
-void twoledsflapup(uint8_t n)
-{
-  	for (uint8_t r=0; r<n; r++)
-	{
-		for (int8_t i=0; i<20; i++)
-		{
-			setled(19-i,19-i);
-			if (waituntil(25)) {return; }
-		}
+	target += seqpos;
+	state = 0;
+	for (;;) {
+		startpart();
+		runticks = 0;
+		for (i = RUN_STEPS; i; i--) runticks += steplength;
+		playticks = 0;
+		for (i = lastrun - firstrun; i; i--) playticks += runticks;
+		partticks = 0;
+		for (i = sequence[state-1].repeats; i; i--) partticks += playticks;
+		if (target - pos < partticks) break; // target is in this part
+		pos += partticks;
 	}
+	for (; target - pos >= playticks; pos += playticks) repeat++;
+	for (; target - pos >= runticks; pos += runticks) run++;
+	for (; target - pos >= steplength; pos += steplength) step++;
+	previoustime += pos;
+	seqpos = pos;
 }
 
-void twoledsflap(uint8_t n)
+/*******************************************************************************
+* startstep() lights the LEDs of the step and sets steptime: its length, with
+* at most COUPLING_SLEW ms of phaseadjust worked off. A step that should have
+* ended over 128 ms ago (after join() or a reset, the sequence starts in the
+* past) is not played: skipahead() moves on to the step of the group first.
+*/
+void startstep(void)
 {
-  	for (uint8_t r=0; r<n; r++)
-	{
-		for (int8_t i=0; i<20; i++)
-		{
-			setled(i,i);
-			if (waituntil(25)) {return; }
-		}
-		for (int8_t i=0; i<20; i++)
-		{
-			setled(19-i,19-i);
-			if (waituntil(25)) {return; }
-		}
+	uint8_t left, right;
+
+	if (elapsed(previoustime) >= (uint16_t)steplength + 128) skipahead();
+	left = runs[run].left;
+	right = runs[run].right;
+#ifdef PATTERNSLOT
+	if (slotplaying) {
+		left = slot[run - firstrun].left;
+		right = slot[run - firstrun].right;
 	}
+#endif
+	stat_start();
+	setled(ledindex(left,step),ledindex(right,step));
+	stat_stop(setledtime);
+
+	steptime = steplength;
+#ifndef HARDSYNC
+	int8_t slew = 0;
+	if (phaseadjust > COUPLING_SLEW) slew = COUPLING_SLEW;
+	else if (phaseadjust < -COUPLING_SLEW) slew = -COUPLING_SLEW;
+	else slew = (int8_t)phaseadjust;
+	phaseadjust -= slew;
+	steptime += slew;
+#endif
 }
 
-uint8_t const randomsequence[]={ 9,19,3,2,16,17,6,18,1,8,0,14,15,5,7,10,11,12,4,10,10,1,15,8,17,9,6,16,7,13,11,0,2,3,4,18,12,14,5,19 };
-void twoledsrandom(uint8_t n)
+/*******************************************************************************
+* patterntask() ends the current step once it has taken steptime ms, moves on
+* and starts the next one.
+* returns 1 if it started a step
+*/
+uint8_t patterntask(void)
 {
-  	for (uint8_t r=0; r<n; r++)
-	{
-		for (int8_t i=0; i<20; i++)
-		{
-			setled(randomsequence[i],randomsequence[i+20]);
-			if (waituntil(25)) {return; }
-		}
-		for (int8_t i=0; i<20; i++)
-		{
-			setled(randomsequence[i+20],randomsequence[i]);
-			if (waituntil(25)) {return; }
-		}
-		for (int8_t i=0; i<20; i++)
-		{
-			setled(randomsequence[19-i],randomsequence[39-i]);
-			if (waituntil(25)) {return; }
-		}
-		for (int8_t i=0; i<20; i++)
-		{
-			setled(randomsequence[39-i],randomsequence[19-i]);
-			if (waituntil(25)) {return; }
+	if (steptime) {
+		uint8_t time = elapsed8(previoustime);
+		if (time < steptime) return(0);
+		stat_late(time - steptime);
+		previoustime += steptime;
+		seqpos += steplength;
+		dithertrim();
+		if (seqpos >= SEQUENCE_TICKS/2 && seqpos - steplength < SEQUENCE_TICKS/2) {
+			// the middle of the sequence, which unlike its end every
+			// badge reaches
+			if (quiet < 255) quiet++; // see endsequence()
+#ifdef PATTERNSLOT
+			// far from the sync frames at the end, see the pattern slot
+			if (chunkquiet < 255) chunkquiet++;
+			if (power < POWER_SPARSE && chunkquiet > CHUNK_CYCLES
+					&& !txheld && slotmask == SLOT_FULL
+					&& !(random8() & ((1 << txodds) - 1)))
+				chunkdue = 1;
+#endif
+#ifdef SERIALDUMP
+			dumpdue = 1; // see housekeeping()
+#endif
 		}
 	}
+	if (!nextstep()) {
+		endsequence();
+		nextstep();
+	}
+	startstep();
+	return(1);
 }
 
-
 /*******************************************************************************
-* Arduino-like loop() function called from main()
+* housekeeping() does what is due once per sequence and is not urgent: the
+* supply check at its end, when no frame is on the air (see checkpower()),
+* and with INSTRUMENT or TRACE the dumps on PA5 in its middle.
+* returns 1 if it did either
 */
-void loop()
+uint8_t housekeeping(void)
 {
-	state++; // pre-switch-statement increment - if state is reset, this will immediately increment it, so first state is 1
-	switch (state)
-	{
-		case 1:	singleledccw(4); break;
-		case 2:	singleledcw(4); break;
-		case 3:	twoledsccw(8); break;
-		case 4:	twoledscw(8); break;
-		case 5:	twoledsflapdown(8); break;
-		case 6:	twoledsflapup(8); break;
-		case 7:	twoledsflap(4); break;
-		case 8:	twoledsrandom(4); break;
-		default: // may not be rached by every badge
-			syncpulse(25);
-			state=0; // will immediately be incremented
-		break;
+#ifdef SERIALDUMP
+	if (dumpdue) {
+		dumpdue = 0;
+		stat_dump();
+		trace_dump();
+		return(1);
+	}
+#endif
+	if (powerdue && !syncbusy() && !channelbusy()) {
+		powerdue = 0;
+		checkpower();
+		return(1);
 	}
+	return(0);
 }
 
 
 /*******************************************************************************
-* Arduino-like setup() and loop() glue in main()
+* main() runs the tasks to completion: every call does at most one bounded
+* piece of work and returns, so none of them waits for the others and the
+* stack is never deeper than a single task. After every piece of work it
+* starts again from the top, so the earlier tasks take priority, and once none
+* has anything to do the core sleeps until the next interrupt (idle()). That
+* is at most one T16 period away, so the tasks are looked at at least once per
+* T16 period, and each gets to run:
+* patterntask()	within one T16 period of the end of a step, plus the longest
+*		piece of work of a lower task that was already running
+* rxtask()	once the step that is due has started
+* slottask()	the same for a pattern chunk
+* txtask()	after that, so a sync frame goes out right at the end of the
+*		sequence
+* housekeeping()	whenever the others have nothing to do
+* The longest pieces of work are learndrift() (a long division) and, with
+* INSTRUMENT, the 8 ms counter dump. They can only delay the step that is due:
+* the steps are timed from their deadlines, so that does not add up. The IR
+* frames themselves are sent and received symbol by symbol in the interrupts
+* (see sendunit() and receiveedge()), independent of the tasks.
 */
 void main()
 {
 	setup();
-	while (1) loop();
+	while (1) {
+		if (patterntask()) continue;
+		if (rxtask()) continue;
+		if (slottask()) continue;
+		if (txtask()) continue;
+		if (housekeeping()) continue;
+		idle();
+	}
 }
-
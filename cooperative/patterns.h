@@ -0,0 +1,51 @@
+/*******************************************************************************
+* Generated from patterns.txt by the pattern compiler (tools/patc.c), edit that
+* instead. The patterns and the sequence as main.c plays them, see there.
+*/
+
+#define LEDTABLE_SIZE	40		// indices in ledsequence[]
+
+const uint8_t ledsequence[] = {
+	PACK5( 9,19, 3, 2,16,17, 6,18),
+	PACK5( 1, 8, 0,14,15, 5, 7,10),
+	PACK5(11,12, 4,10,10, 1,15, 8),
+	PACK5(17, 9, 6,16, 7,13,11, 0),
+	PACK5( 2, 3, 4,18,12,14, 5,19)
+};
+
+const run_t runs[] = {
+	{ TRACK_UP | 0, TRACK_OFF },				// 0: singleledccw
+	{ TRACK_OFF, TRACK_DOWN | 19 },
+	{ TRACK_OFF, TRACK_UP | 0 },				// 2: singleledcw
+	{ TRACK_DOWN | 19, TRACK_OFF },
+	{ TRACK_UP | 0, TRACK_DOWN | 19 },			// 4: twoledsccw
+	{ TRACK_DOWN | 19, TRACK_UP | 0 },			// 5: twoledscw
+	{ TRACK_UP | 0, TRACK_UP | 0 },				// 6: twoledsflapdown
+	{ TRACK_DOWN | 19, TRACK_DOWN | 19 },			// 7: twoledsflapup
+	{ TRACK_TABLE | TRACK_UP | 0, TRACK_TABLE | TRACK_UP | 20 },	// 8: twoledsrandom
+	{ TRACK_TABLE | TRACK_UP | 20, TRACK_TABLE | TRACK_UP | 0 },
+	{ TRACK_TABLE | TRACK_DOWN | 19, TRACK_TABLE | TRACK_DOWN | 39 },
+	{ TRACK_TABLE | TRACK_DOWN | 39, TRACK_TABLE | TRACK_DOWN | 19 }
+};
+
+#define PATTERNS(X) \
+	X(SINGLELEDCCW,		0, 2, 25) \
+	X(SINGLELEDCW,		2, 2, 25) \
+	X(TWOLEDSCCW,		4, 1, 25) \
+	X(TWOLEDSCW,		5, 1, 25) \
+	X(TWOLEDSFLAPDOWN,	6, 1, 25) \
+	X(TWOLEDSFLAPUP,	7, 1, 25) \
+	X(TWOLEDSFLAP,		6, 2, 25) \
+	X(TWOLEDSRANDOM,	8, 4, 25) \
+	X(SLOT,			4, 4, 25)
+
+#define SEQUENCE(X) \
+	X(SINGLELEDCCW,		4) \
+	X(SINGLELEDCW,		4) \
+	X(TWOLEDSCCW,		8) \
+	X(TWOLEDSCW,		8) \
+	X(TWOLEDSFLAPDOWN,	8) \
+	X(TWOLEDSFLAPUP,	8) \
+	X(TWOLEDSFLAP,		4) \
+	X(TWOLEDSRANDOM,	4) \
+	X(SLOT,			1)
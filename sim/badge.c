@@ -0,0 +1,415 @@
+/*******************************************************************************
+* (c) 2023 by Theo Borm
+* see LICENSE file in the root directory of this repository
+*
+* Emulation of one badge for the host build, see badge.h
+*******************************************************************************/
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "badge.h"
+
+badge_t *sim_badge;
+sim_regs_t *sim_regs;
+
+#define SIM_ILRC	55e3		// nominal ILRC frequency
+#define SIM_BANDGAP	1.20		// bandgap reference, V
+
+/*******************************************************************************
+* LED map: the pins at the plus and minus side of every LED, as on the PCB.
+* This is deliberately not taken from main.c, so that the emulation checks the
+* firmware's pin tables instead of repeating them.
+*******************************************************************************/
+
+#define SIM_PA0	0
+#define SIM_PA7	7
+#define SIM_PB0	8
+#define SIM_PB1	9
+#define SIM_PB2	10
+#define SIM_PB3	11
+#define SIM_PB4	12
+#define SIM_PB5	13
+#define SIM_PB6	14
+#define SIM_PB7	15
+
+static const uint8_t ledpins[SIM_LEDS][2] = {
+	{ SIM_PB4, SIM_PA7 },	// L00
+	{ SIM_PB4, SIM_PB7 },	// L01
+	{ SIM_PB4, SIM_PB6 },	// L02
+	{ SIM_PB4, SIM_PB5 },	// L03
+	{ SIM_PB5, SIM_PA7 },	// L04
+	{ SIM_PB5, SIM_PB7 },	// L05
+	{ SIM_PB5, SIM_PB6 },	// L06
+	{ SIM_PB5, SIM_PB4 },	// L07
+	{ SIM_PB6, SIM_PA7 },	// L08
+	{ SIM_PB6, SIM_PB7 },	// L09
+	{ SIM_PB6, SIM_PB5 },	// L10
+	{ SIM_PB6, SIM_PB4 },	// L11
+	{ SIM_PB7, SIM_PA7 },	// L12
+	{ SIM_PB7, SIM_PB6 },	// L13
+	{ SIM_PB7, SIM_PB5 },	// L14
+	{ SIM_PB7, SIM_PB4 },	// L15
+	{ SIM_PA7, SIM_PB7 },	// L16
+	{ SIM_PA7, SIM_PB6 },	// L17
+	{ SIM_PA7, SIM_PB5 },	// L18
+	{ SIM_PA7, SIM_PB4 },	// L19
+	{ SIM_PB3, SIM_PA0 },	// R00
+	{ SIM_PB3, SIM_PB0 },	// R01
+	{ SIM_PB3, SIM_PB1 },	// R02
+	{ SIM_PB3, SIM_PB2 },	// R03
+	{ SIM_PB2, SIM_PA0 },	// R04
+	{ SIM_PB2, SIM_PB0 },	// R05
+	{ SIM_PB2, SIM_PB1 },	// R06
+	{ SIM_PB2, SIM_PB3 },	// R07
+	{ SIM_PB1, SIM_PA0 },	// R08
+	{ SIM_PB1, SIM_PB0 },	// R09
+	{ SIM_PB1, SIM_PB2 },	// R10
+	{ SIM_PB1, SIM_PB3 },	// R11
+	{ SIM_PB0, SIM_PA0 },	// R12
+	{ SIM_PB0, SIM_PB1 },	// R13
+	{ SIM_PB0, SIM_PB2 },	// R14
+	{ SIM_PB0, SIM_PB3 },	// R15
+	{ SIM_PA0, SIM_PB0 },	// R16
+	{ SIM_PA0, SIM_PB1 },	// R17
+	{ SIM_PA0, SIM_PB2 },	// R18
+	{ SIM_PA0, SIM_PB3 },	// R19
+};
+
+const char *sim_ledname[SIM_LEDS] = {
+	"L00", "L01", "L02", "L03", "L04", "L05", "L06", "L07", "L08", "L09",
+	"L10", "L11", "L12", "L13", "L14", "L15", "L16", "L17", "L18", "L19",
+	"R00", "R01", "R02", "R03", "R04", "R05", "R06", "R07", "R08", "R09",
+	"R10", "R11", "R12", "R13", "R14", "R15", "R16", "R17", "R18", "R19",
+};
+
+// 16 bit views of the port registers, PA in the low byte
+static uint16_t outputs(badge_t *b) {
+	return b->regs.pac | b->regs.pbc << 8;
+}
+static uint16_t levels(badge_t *b) {
+	return b->regs.pa | b->regs.pb << 8;
+}
+
+uint64_t badge_ledmask(badge_t *b)
+{
+	uint16_t out = outputs(b), high = levels(b) & out, low = ~levels(b) & out;
+	uint64_t mask = 0;
+	for (int i = 0; i < SIM_LEDS; i++)
+		if ((high >> ledpins[i][0] & 1) && (low >> ledpins[i][1] & 1))
+			mask |= (uint64_t)1 << i;
+	return mask;
+}
+
+// the level on every pin: driven outputs, the IR receiver on PA4, inputs
+// with their pull-up high and other inputs low
+uint16_t badge_pins(badge_t *b)
+{
+	uint16_t out = outputs(b), pullup = b->regs.paph | b->regs.pbph << 8;
+	uint16_t pins = (levels(b) & out) | (pullup & ~out);
+	if (!(out & 0x10)) pins = (pins & ~0x10) | b->rxlevel << 4;
+	return pins;
+}
+
+/*******************************************************************************
+* T16: the count is kept as a 64 bit value from the last reconfiguration, so
+* interrupt times can be computed exactly instead of stepping the counter.
+*******************************************************************************/
+
+static double t16source(badge_t *b) {
+	if (b->stopped) return 0;
+	switch (b->t16m & 0xe0) {
+		case T16M_CLK_SYSCLK: return b->sysdiv ? b->ihrc / b->sysdiv : SIM_ILRC;
+		case T16M_CLK_IHRC: return b->ihrc;
+		case T16M_CLK_ILRC: return SIM_ILRC;
+		default: return 0;
+	}
+}
+
+static uint64_t t16counts(badge_t *b, double t) {
+	if (b->t16rate == 0) return b->t16count;
+	return b->t16count + (uint64_t)((t - b->t16time) * b->t16rate);
+}
+
+// the interrupt fires when the selected bit rises (INTEGS.4 = 0) or falls
+static void t16schedule(badge_t *b, uint64_t count) {
+	uint64_t period = (uint64_t)2 << (8 + (b->t16m & 7));
+	uint64_t offset = (b->integs & 0x10) ? 0 : period / 2;
+	uint64_t next = count - count % period + offset;
+	if (next <= count) next += period;
+	b->t16target = next;
+	b->t16next = b->t16rate ? b->t16time + (next - b->t16count) / b->t16rate : INFINITY;
+}
+
+static void t16rebase(badge_t *b, uint64_t count) {
+	b->t16m = b->regs.t16m;
+	b->integs = b->regs.integs;
+	b->t16time = b->now;
+	b->t16count = count;
+	b->t16rate = t16source(b) / (1 << 2 * ((b->t16m >> 3) & 3)) / 1e9;
+	t16schedule(b, count);
+}
+
+volatile uint16_t *sim_t16c(void)
+{
+	badge_t *b = sim_badge;
+	badge_spin(b, b->now + SIM_READ_COST);
+	b->regs.t16c = b->t16shadow = (uint16_t)t16counts(b, b->now);
+	return &b->regs.t16c;
+}
+
+/*******************************************************************************
+* Comparator. Only the internal reference range main.c uses (GPCS bits 5:4 =
+* 00, VDD/4 + n * VDD/32) is modelled; other ranges are treated the same.
+*******************************************************************************/
+
+static double pinvoltage(badge_t *b, int pin) {
+	if (pin == 4 && !(b->regs.pac & 0x10)) return b->rxlevel ? b->vdd : 0;
+	return (levels(b) >> pin & 1) ? b->vdd : 0;
+}
+
+static uint8_t comparator(badge_t *b) {
+	uint8_t gpcc = b->regs.gpcc;
+	double vintr = b->vdd / 4 + (b->regs.gpcs & 0x0f) * b->vdd / 32;
+	double plus, minus;
+	if (!(gpcc & 0x80)) return 0;
+	plus = (gpcc & 0x01) ? pinvoltage(b, 4) : vintr;
+	switch ((gpcc >> 1) & 7) {
+		case 0: minus = pinvoltage(b, 3); break;
+		case 1: minus = pinvoltage(b, 4); break;
+		case 2: minus = SIM_BANDGAP; break;
+		case 3: minus = vintr; break;
+		case 4: minus = pinvoltage(b, 14); break;
+		case 5: minus = pinvoltage(b, 15); break;
+		default: minus = 0;
+	}
+	return (plus > minus) ^ ((gpcc >> 4) & 1);
+}
+
+volatile uint8_t *sim_gpcc(void)
+{
+	badge_t *b = sim_badge;
+	b->regs.gpcc = (b->regs.gpcc & ~0x40) | comparator(b) << 6;
+	return &b->regs.gpcc;
+}
+
+// queue a carrier edge at the receiver, in time order
+static void enqueue(badge_t *b, double t, int on, int echo)
+{
+	int i;
+	t += on ? SIM_RX_ATTACK : SIM_RX_RELEASE;
+	if (b->rxcount == SIM_RXQUEUE) {
+		fprintf(stderr, "sim: receive queue full, carrier dropped\n");
+		return;
+	}
+	for (i = b->rxcount; i > 0 && b->rx[i - 1].time > t; i--)
+		b->rx[i] = b->rx[i - 1];
+	b->rx[i].time = t;
+	b->rx[i].delta = on ? 1 : -1;
+	b->rx[i].echo = echo;
+	b->rxcount++;
+}
+
+/*******************************************************************************
+* Register side effects: everything main.c may have changed since the last
+* look is picked up here, at the current time.
+*******************************************************************************/
+
+static void observe(badge_t *b)
+{
+	uint8_t on, comp;
+
+	if (b->regs.t16c != b->t16shadow) {
+		// main.c wrote T16C
+		t16rebase(b, b->regs.t16c);
+		b->t16shadow = b->regs.t16c;
+	} else if (b->regs.t16m != b->t16m || b->regs.integs != b->integs)
+		t16rebase(b, t16counts(b, b->now));
+
+	on = (b->regs.tm2c & 0xf0) && (b->regs.tm2c & 0x0c) == 0x08;
+	if (on != b->carrier) {
+		b->carrier = on;
+		if (on) {
+			b->carrierstart = b->now;
+			if (b->now - b->carrierstop > SIM_BURST_GAP) b->bursts++;
+		} else {
+			b->carrierstop = b->now;
+			b->irtime += b->now - b->carrierstart;
+		}
+		if (b->echo) enqueue(b, b->now, on, 1);
+		if (b->oncarrier) b->oncarrier(b, b->now, on);
+	}
+
+	comp = comparator(b);
+	if (comp != b->comp) {
+		b->comp = comp;
+		b->regs.intrq |= INTRQ_COMP;
+	}
+}
+
+volatile uint8_t *sim_io(volatile uint8_t *reg)
+{
+	badge_t *b = sim_badge;
+	if (++b->busy >= SIM_BUSY)
+		badge_spin(b, b->now + SIM_READ_COST);
+	observe(b);
+	return reg;
+}
+
+void badge_update(badge_t *b)
+{
+	observe(b);
+	if (b->gie && !b->inisr && (b->regs.intrq & b->regs.inten)) {
+		if (b->regs.intrq & b->regs.inten & INTRQ_T16) b->t16irqs++;
+		if (b->regs.intrq & b->regs.inten & INTRQ_COMP) b->compirqs++;
+		b->inisr = 1;
+		b->isr();
+		b->inisr = 0;
+		observe(b);
+	}
+}
+
+// an interrupt that came up while they were off is taken right away
+void sim_engint(void)
+{
+	sim_badge->gie = 1;
+	badge_update(sim_badge);
+}
+
+void sim_disgint(void)
+{
+	sim_badge->gie = 0;
+}
+
+// STOPSYS: the oscillators stop, and T16 with them, until a pin change wakes
+// the badge up. The carrier is not stopped, main.c switches it off first
+void sim_stopsys(void)
+{
+	badge_t *b = sim_badge;
+	b->stopped = 1;
+	b->stoptime = b->now;
+	t16rebase(b, t16counts(b, b->now));
+	sim_stopexe();
+	b->stopped = 0;
+	t16rebase(b, t16counts(b, b->now));
+}
+
+void sim_sysclock(uint8_t divider)
+{
+	sim_badge->sysdiv = divider;
+}
+
+// the programmer trims the IHRC so the system clock runs at the frequency
+// asked for; what is left is the badge's own error
+void sim_calibrate(uint32_t frequency)
+{
+	badge_t *b = sim_badge;
+	if (b->sysdiv) b->ihrc = (double)frequency * b->sysdiv * (1 + b->ppm * 1e-6);
+}
+
+/*******************************************************************************
+* Time and events
+*******************************************************************************/
+
+void badge_init(badge_t *b, double ppm)
+{
+	memset(b, 0, sizeof *b);
+	b->ppm = ppm;
+	b->ihrc = 16e6 * (1 + ppm * 1e-6);
+	b->sysdiv = 8;
+	b->vdd = 3.0;
+	b->rxlevel = 1;
+	b->echo = 1;
+	b->t16next = INFINITY;
+	b->carrierstop = -INFINITY;
+}
+
+void badge_select(badge_t *b)
+{
+	sim_badge = b;
+	sim_regs = &b->regs;
+}
+
+// move time forward, accounting the LEDs that were lit in the meantime
+void badge_settime(badge_t *b, double t)
+{
+	uint64_t mask = badge_ledmask(b);
+	uint16_t pins = badge_pins(b);
+	if (mask != b->leds) {
+		b->leds = mask;
+		if (mask && mask != b->lit) {
+			b->lit = mask;
+			if (b->onleds) b->onleds(b, b->now, mask);
+		}
+	}
+	if (pins != b->pins) {
+		b->pins = pins;
+		if (b->onpins) b->onpins(b, b->now, pins);
+	}
+	if (t <= b->now) return;
+	b->busy = 0;
+	for (int i = 0; i < SIM_LEDS; i++)
+		if (mask >> i & 1) b->ledtime[i] += t - b->now;
+	b->now = t;
+}
+
+double badge_nextevent(badge_t *b)
+{
+	double t = b->t16next;
+	if (b->rxcount && b->rx[0].time < t) t = b->rx[0].time;
+	return t;
+}
+
+// handle the next event, returns 1 if it ends STOPEXE
+int badge_event(badge_t *b)
+{
+	int wake = 0;
+	double t = badge_nextevent(b);
+
+	if (t == INFINITY) return 0;
+	badge_settime(b, t);
+	if (b->rxcount && b->rx[0].time == t) {
+		uint8_t level;
+		if (b->rx[0].delta > 0) {
+			if (!b->rx[0].echo) b->receptions++;
+			if (b->carriers > 0) b->collisions++;
+		}
+		b->carriers += b->rx[0].delta;
+		memmove(b->rx, b->rx + 1, --b->rxcount * sizeof b->rx[0]);
+		level = b->carriers <= 0;
+		if (level != b->rxlevel) {
+			b->rxlevel = level;
+			if (!(b->regs.pac & 0x10))
+				b->regs.pa = (b->regs.pa & ~0x10) | level << 4;
+			wake = (b->regs.padier & 0x10) != 0;
+		}
+	} else {
+		b->regs.intrq |= INTRQ_T16;
+		t16schedule(b, b->t16target);
+		wake = 1;
+	}
+	badge_update(b);
+	return wake;
+}
+
+// run until time t without sleeping, interrupts are serviced on the way
+void badge_spin(badge_t *b, double t)
+{
+	while (badge_nextevent(b) <= t)
+		badge_event(b);
+	badge_settime(b, t);
+	badge_update(b);
+}
+
+// a carrier starts (on) or stops reaching this badge's receiver at time t
+void badge_receive(badge_t *b, double t, int on)
+{
+	enqueue(b, t, on, 0);
+}
+
+// close the books at the end of a run
+void badge_finish(badge_t *b)
+{
+	badge_settime(b, b->now);
+	if (b->carrier) b->irtime += b->now - b->carrierstart;
+}
@@ -0,0 +1,108 @@
+/*******************************************************************************
+* (c) 2023 by Theo Borm
+* see LICENSE file in the root directory of this repository
+*
+* Emulation of one badge: the PFS154 peripherals main.c uses (T16, TM2 carrier
+* output, comparator, port pins, interrupts) and the IR receiver on PA4.
+*
+* The emulated CPU executes in zero time: main.c runs on the host until it
+* enters STOPEXE (or reads T16C), and simulated time only advances between
+* those points. That is exact for this firmware, which does all its timing
+* with T16 and sleeps in between.
+*
+* All times are in nanoseconds of simulated time.
+*******************************************************************************/
+
+#ifndef SIM_BADGE_H
+#define SIM_BADGE_H
+
+#include <stdint.h>
+#include "device.h"
+
+#define SIM_LEDS	40		// L00..L19, then R00..R19
+#define SIM_RXQUEUE	512
+
+// IR receiver (TSOP style): output low some time after the carrier starts,
+// back high some time after it stops
+#define SIM_RX_ATTACK	250e3
+#define SIM_RX_RELEASE	300e3
+
+// carrier marks less than this apart are one transmission (a coded frame)
+#define SIM_BURST_GAP	20e6
+
+// time charged for every T16C read, and for every SIM_BUSY register accesses
+// without sleeping, so polling loops make progress
+#define SIM_READ_COST	2e3
+#define SIM_BUSY	1000
+
+typedef struct badge badge_t;
+
+struct badge {
+	sim_regs_t regs;
+	double now;
+	double ihrc;			// actual IHRC frequency
+	double ppm;			// IHRC error after calibration
+	uint8_t sysdiv;			// system clock = IHRC / sysdiv, 0 = ILRC
+	void (*isr)(void);		// the firmware's interrupt dispatcher
+	uint8_t gie;
+	uint8_t inisr;
+	uint16_t busy;			// register accesses since time last moved
+	uint8_t stopped;		// in STOPSYS, the oscillators are off
+	double stoptime;		// when it last entered STOPSYS
+
+	// T16 runs from (t16time, t16count) at t16rate counts per ns
+	uint8_t t16m, integs;
+	double t16time, t16rate;
+	uint64_t t16count;
+	uint64_t t16target;		// count at the next T16 interrupt
+	double t16next;			// and its time
+	uint16_t t16shadow;		// last T16C value handed out
+
+	// comparator
+	uint8_t comp;			// last comparator output
+	double vdd;			// supply, the callers may change it
+
+	// IR: received carriers, transmitted carrier
+	struct { double time; int8_t delta, echo; } rx[SIM_RXQUEUE];
+	uint16_t rxcount;
+	int carriers;			// carriers currently seen by the receiver
+	uint8_t rxlevel;		// receiver output, on PA4
+	uint8_t carrier;		// TM2 carrier on PA3
+	double carrierstart, carrierstop;
+	uint8_t echo;			// receiver sees the own transmitter
+
+	// observation
+	uint64_t leds;			// LEDs lit right now
+	uint64_t lit;			// LEDs last seen lit, see onleds
+	uint16_t pins;			// pin levels, PA in the low byte
+	double ledtime[SIM_LEDS];
+	double irtime;
+	uint32_t bursts;		// transmissions, see SIM_BURST_GAP
+	uint32_t wakeups, t16irqs, compirqs;
+	uint32_t receptions;		// carrier marks from other badges received
+	uint32_t collisions;		// marks that arrived on top of another
+	// changes of the lit LEDs; moments with all LEDs dark are left out,
+	// those are PWM gaps (BATTERYSAVER), the sequence itself never does that
+	void (*onleds)(badge_t *, double time, uint64_t leds);
+	void (*onpins)(badge_t *, double time, uint16_t pins);
+	void (*oncarrier)(badge_t *, double time, int on);
+	void *user;
+};
+
+extern badge_t *sim_badge;
+
+void badge_init(badge_t *b, double ppm);
+void badge_select(badge_t *b);
+void badge_settime(badge_t *b, double t);
+void badge_update(badge_t *b);
+double badge_nextevent(badge_t *b);
+int badge_event(badge_t *b);
+void badge_spin(badge_t *b, double t);
+void badge_receive(badge_t *b, double t, int on);
+uint64_t badge_ledmask(badge_t *b);
+uint16_t badge_pins(badge_t *b);
+void badge_finish(badge_t *b);
+
+extern const char *sim_ledname[SIM_LEDS];
+
+#endif
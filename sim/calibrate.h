@@ -0,0 +1,16 @@
+/*******************************************************************************
+* (c) 2023 by Theo Borm
+* see LICENSE file in the root directory of this repository
+*
+* Host stand-in for the easy-pdk-includes <calibrate.h>, used by "make host".
+* The programmer trims the IHRC while writing the part; in the emulation the
+* badge simply runs at the requested frequency plus its configured error.
+*******************************************************************************/
+
+#ifndef SIM_CALIBRATE_H
+#define SIM_CALIBRATE_H
+
+#define EASY_PDK_CALIBRATE_IHRC(frequency,millivolt)	sim_calibrate(frequency)
+#define EASY_PDK_CALIBRATE_ILRC(frequency,millivolt)
+
+#endif
@@ -0,0 +1,129 @@
+/*******************************************************************************
+* (c) 2023 by Theo Borm
+* see LICENSE file in the root directory of this repository
+*
+* Host stand-in for the pdk-includes <device.h>, used by "make host".
+*
+* The special function registers of the PFS154 become fields of a register
+* file (sim_regs_t). The register names expand to the fields of the register
+* file of the badge that is currently running, so main.c compiles unchanged.
+* Every access goes through sim_io() first, which lets the emulation catch up
+* with the side effects of the previous writes (a comparator that was just
+* enabled raises INTRQ_COMP before main.c gets to clear INTRQ, as on the real
+* part). Registers whose value depends on time or on the outside world (T16C,
+* GPCC) are read through their own function.
+*
+* Only the constants main.c actually uses are defined; their values match
+* pdk-includes, because the emulation in badge.c decodes them.
+*******************************************************************************/
+
+#ifndef SIM_DEVICE_H
+#define SIM_DEVICE_H
+
+#include <stdint.h>
+
+typedef struct {
+	volatile uint8_t pa, pac, paph, padier;
+	volatile uint8_t pb, pbc, pbph, pbdier;
+	volatile uint8_t inten, intrq, integs;
+	volatile uint8_t t16m;
+	volatile uint16_t t16c;
+	volatile uint8_t tm2c, tm2ct, tm2b, tm2s;
+	volatile uint8_t gpcc, gpcs;
+	volatile uint8_t clkmd, ihrcr, misc;
+} sim_regs_t;
+
+extern sim_regs_t *sim_regs;
+
+volatile uint8_t *sim_io(volatile uint8_t *reg);
+volatile uint16_t *sim_t16c(void);
+volatile uint8_t *sim_gpcc(void);
+void sim_engint(void);
+void sim_disgint(void);
+void sim_stopexe(void);
+void sim_stopsys(void);
+void sim_sysclock(uint8_t divider);
+void sim_calibrate(uint32_t frequency);
+
+#define PA		(*sim_io(&sim_regs->pa))
+#define PAC		(*sim_io(&sim_regs->pac))
+#define PAPH		(*sim_io(&sim_regs->paph))
+#define PADIER		(*sim_io(&sim_regs->padier))
+#define PB		(*sim_io(&sim_regs->pb))
+#define PBC		(*sim_io(&sim_regs->pbc))
+#define PBPH		(*sim_io(&sim_regs->pbph))
+#define PBDIER		(*sim_io(&sim_regs->pbdier))
+#define INTEN		(*sim_io(&sim_regs->inten))
+#define INTRQ		(*sim_io(&sim_regs->intrq))
+#define INTEGS		(*sim_io(&sim_regs->integs))
+#define T16M		(*sim_io(&sim_regs->t16m))
+#define T16C		(*sim_t16c())
+#define TM2C		(*sim_io(&sim_regs->tm2c))
+#define TM2CT		(*sim_io(&sim_regs->tm2ct))
+#define TM2B		(*sim_io(&sim_regs->tm2b))
+#define TM2S		(*sim_io(&sim_regs->tm2s))
+#define GPCC		(*sim_gpcc())
+#define GPCS		(*sim_io(&sim_regs->gpcs))
+#define CLKMD		(*sim_io(&sim_regs->clkmd))
+#define IHRCR		(*sim_io(&sim_regs->ihrcr))
+#define MISC		(*sim_io(&sim_regs->misc))
+
+// interrupt enable / request bits
+#define INTEN_PA0		0x01
+#define INTEN_PB0		0x02
+#define INTEN_T16		0x04
+#define INTEN_COMP		0x10
+#define INTEN_PWMG		0x20
+#define INTEN_TM2		0x40
+#define INTEN_TM3		0x80
+#define INTRQ_PA0		0x01
+#define INTRQ_PB0		0x02
+#define INTRQ_T16		0x04
+#define INTRQ_COMP		0x10
+#define INTRQ_PWMG		0x20
+#define INTRQ_TM2		0x40
+#define INTRQ_TM3		0x80
+
+// T16M: clock source [7:5], prescaler [4:3], interrupt source [2:0]
+#define T16M_CLK_DISABLE	0x00
+#define T16M_CLK_SYSCLK		0x20
+#define T16M_CLK_PA4_FALL	0x60
+#define T16M_CLK_IHRC		0x80
+#define T16M_CLK_EOSC		0xa0
+#define T16M_CLK_ILRC		0xc0
+#define T16M_CLK_PA0_FALL	0xe0
+#define T16M_CLK_DIV1		0x00
+#define T16M_CLK_DIV4		0x08
+#define T16M_CLK_DIV16		0x10
+#define T16M_CLK_DIV64		0x18
+#define T16M_INTSRC_8BIT	0x00
+#define T16M_INTSRC_9BIT	0x01
+#define T16M_INTSRC_10BIT	0x02
+#define T16M_INTSRC_11BIT	0x03
+#define T16M_INTSRC_12BIT	0x04
+#define T16M_INTSRC_13BIT	0x05
+#define T16M_INTSRC_14BIT	0x06
+#define T16M_INTSRC_15BIT	0x07
+
+// system clock: the value is the IHRC divider, 0 selects the ILRC
+#define SYSCLOCK_IHRC_16MHZ	1
+#define SYSCLOCK_IHRC_8MHZ	2
+#define SYSCLOCK_IHRC_4MHZ	4
+#define SYSCLOCK_IHRC_2MHZ	8
+#define SYSCLOCK_IHRC_1MHZ	16
+#define SYSCLOCK_IHRC_500KHZ	32
+#define SYSCLOCK_IHRC_250KHZ	64
+#define SYSCLOCK_ILRC		0
+
+#define PDK_SET_SYSCLOCK(c)	sim_sysclock(c)
+
+// SDCC pdk intrinsics
+#define __interrupt(n)
+#define __engint()		sim_engint()
+#define __disgint()		sim_disgint()
+#define __stopexe()		sim_stopexe()
+#define __stopsys()		sim_stopsys()
+#define __nop()
+#define __wdreset()
+
+#endif
@@ -0,0 +1,292 @@
+/*******************************************************************************
+* (c) 2023 by Theo Borm
+* see LICENSE file in the root directory of this repository
+*
+* Single badge simulation, built and run by "make host".
+*
+* Runs main.c on one emulated badge for a while and reports how well it keeps
+* time: the error of every LED step against the nominal step time, the on-time
+* of every LED, the length of the whole LED sequence, and a few power related
+* numbers (IR carrier on-time, wake-ups). Other badges can be faked with
+* periodic IR pulses to see how the firmware responds to them. Anything sent
+* on PA5 as 9600 baud serial (the INSTRUMENT build option) is decoded too,
+* and framing errors are counted.
+*
+* usage: label_host [options]
+*	-d seconds	simulated time (80)
+*	-c ppm		IHRC error of the badge (0)
+*	-t ms		nominal LED step time (25)
+*	-p ms		period of fake IR pulses from another badge (0 = none)
+*	-o ms		time of the first fake pulse (1000)
+*	-w ms		length of the fake pulses (25)
+*	-b volts	supply at the end, falling linearly from 3 V (3)
+*	-e		the receiver does not see the badge's own transmitter
+*	-v		log every IR burst and serial frame
+*******************************************************************************/
+
+#include <math.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "badge.h"
+#include "steps.h"
+
+// main.c, with main() renamed by the Makefile
+unsigned char _sdcc_external_startup(void);
+void firmware_main(void);
+void interrupt(void);
+
+static badge_t badge;
+static jmp_buf finished;
+static double endtime;
+static double vstart = 3.0, vend = 3.0;
+static int verbose;
+
+// fake pulses from another badge, fed to the receiver as time goes by
+static double pulseperiod, pulsetime, pulsewidth;
+
+static void feedpulses(badge_t *b)
+{
+	while (pulseperiod > 0 && pulsetime < endtime && pulsetime < b->now + 1e9
+			&& b->rxcount < SIM_RXQUEUE - 4) {
+		badge_receive(b, pulsetime, 1);
+		badge_receive(b, pulsetime + pulsewidth, 0);
+		if (verbose) printf("%10.3f ms  fake pulse\n", pulsetime / 1e6);
+		pulsetime += pulseperiod;
+	}
+}
+
+// STOPEXE: sleep until an event wakes the badge, or stop at the end of the run
+void sim_stopexe(void)
+{
+	badge_t *b = sim_badge;
+	b->wakeups++;
+	b->vdd = vstart + (vend - vstart) * b->now / endtime;
+	badge_update(b);
+	do {
+		feedpulses(b);
+		if (badge_nextevent(b) > endtime) {
+			badge_settime(b, endtime);
+			longjmp(finished, 1);
+		}
+	} while (!badge_event(b));
+}
+
+/*******************************************************************************
+* Observation: every change of the lit LEDs is one step
+*******************************************************************************/
+
+static steps_t steps;
+
+static void onleds(badge_t *b, double time, uint64_t leds)
+{
+	steps_add(&steps, time, leds);
+}
+
+static void oncarrier(badge_t *b, double time, int on)
+{
+	if (verbose) printf("%10.3f ms  IR carrier %s\n", time / 1e6, on ? "on" : "off");
+}
+
+/*******************************************************************************
+* Serial monitor: 9600 baud 8N1 on PA5, decoded from the pin edges. Bytes
+* less than two byte times apart belong to the same frame.
+*******************************************************************************/
+
+#define SERIAL_PIN	5
+#define SERIAL_BIT	(1e9 / 9600)
+#define SERIAL_FRAME	256
+
+static int serialbits = -1;		// bits of the current byte, -1 idle
+static double serialstart, serialend;
+static uint8_t serialbyte, seriallevel = 1;
+static uint8_t frame[SERIAL_FRAME];
+static int framelength;
+static double frametime;
+static uint32_t serialbytes, serialerrors;
+
+static void printframe(void)
+{
+	printf("%10.3f ms  PA5:", frametime / 1e6);
+	for (int i = 0; i < framelength; i++) printf(" %02x", frame[i]);
+	printf("\n");
+}
+
+// the line changes to level at time t
+static void serialedge(double t, uint8_t level)
+{
+	// sample the bits that were due before t, in the middle of every bit
+	while (serialbits >= 0) {
+		double sample = serialstart + (serialbits + 0.5) * SERIAL_BIT;
+		if (sample >= t) break;
+		if (serialbits >= 1 && serialbits <= 8)
+			serialbyte |= seriallevel << (serialbits - 1);
+		if (serialbits++ < 9) continue;
+		serialbits = -1;
+		if (!seriallevel) {		// framing error
+			serialerrors++;
+			continue;
+		}
+		if (serialstart - serialend > 20 * SERIAL_BIT || framelength == SERIAL_FRAME) {
+			if (verbose && framelength) printframe();
+			framelength = 0;
+			frametime = serialstart;
+		}
+		frame[framelength++] = serialbyte;
+		serialend = sample;
+		serialbytes++;
+	}
+	if (serialbits < 0 && seriallevel && !level) {
+		serialbits = 0;
+		serialbyte = 0;
+		serialstart = t;
+	}
+	seriallevel = level;
+}
+
+static void onpins(badge_t *b, double time, uint16_t pins)
+{
+	uint8_t level = pins >> SERIAL_PIN & 1;
+	if (level != seriallevel) serialedge(time, level);
+}
+
+/*******************************************************************************
+* Reports
+*******************************************************************************/
+
+// step timing, skipped when the LEDs change faster than every half step on
+// average (LEDSCAN). Consecutive steps can light the same LEDs, so a change
+// may be the end of several steps; the error is taken against the nearest
+// whole number of them
+static int reportsteps(double nominal)
+{
+	size_t n = 0, off = 0;
+	double sum = 0, sumsq = 0, worst = 0, average = 0;
+
+	if (steps.n > 1)
+		average = (steps.step[steps.n - 1].time - steps.step[0].time) / (steps.n - 1);
+	if (steps.n > 1 && average < nominal / 2) {
+		printf("step timing: LEDs change every %.3f ms on average, "
+			"steps are not visible on the pins\n", average / 1e6);
+		return 0;
+	}
+	for (size_t i = 1; i < steps.n; i++) {
+		double interval = steps.step[i].time - steps.step[i - 1].time;
+		double count = round(interval / nominal), error;
+		if (count < 1) count = 1;
+		error = interval - count * nominal;
+		n += count;
+		sum += error;
+		sumsq += error * error;
+		if (fabs(error) > fabs(worst)) worst = error;
+		if (fabs(error) > 1e6) off++;
+	}
+	if (!n) {
+		printf("step timing: no steps\n");
+		return 0;
+	}
+	printf("step timing: %zu steps of %.3f ms, error mean %+.3f ms, "
+		"rms %.3f ms, worst %+.3f ms, %zu off by more than 1 ms\n",
+		n, nominal / 1e6, sum / n / 1e6, sqrt(sumsq / n) / 1e6,
+		worst / 1e6, off);
+	return 1;
+}
+
+// the length of the whole sequence, from the period of the LED changes
+static void reportcycle(void)
+{
+	size_t period = steps_period(&steps), cycles;
+
+	if (!period) {
+		printf("sequence cycle: no repeat seen in %zu LED changes, "
+			"run longer (-d) to measure it\n", steps.n);
+		return;
+	}
+	// measured from the second step: when a cycle ends with the LEDs it
+	// starts with, the first step of the next cycle is not a change
+	cycles = (steps.n - 2) / period;
+	printf("sequence cycle: %.3f ms, %zu LED changes (%zu cycles seen)\n",
+		(steps.step[1 + cycles * period].time - steps.step[1].time)
+		/ cycles / 1e6, period, cycles);
+}
+
+static void reportleds(double duration)
+{
+	printf("LED on-time, %% of the simulated time:\n");
+	for (int i = 0; i < SIM_LEDS; i++)
+		printf("%s %5.2f%s", sim_ledname[i], 100 * badge.ledtime[i] / duration,
+			i % 10 == 9 ? "\n" : "  ");
+}
+
+static void reportpower(double duration)
+{
+	double s = duration / 1e9;
+	printf("IR carrier: %u transmissions, %.1f ms on (%.3f%%)\n", badge.bursts,
+		badge.irtime / 1e6, 100 * badge.irtime / duration);
+	printf("wake-ups: %.1f/s, T16 interrupts %.1f/s, comparator "
+		"interrupts %u\n", badge.wakeups / s, badge.t16irqs / s,
+		badge.compirqs);
+	if (badge.stopped)
+		printf("stopped (STOPSYS) at %.3f s, supply %.2f V\n",
+			badge.stoptime / 1e9, vstart + (vend - vstart)
+			* badge.stoptime / duration);
+}
+
+static void reportserial(void)
+{
+	serialedge(INFINITY, seriallevel);
+	if (!serialbytes) return;
+	printf("serial: %u bytes on PA5, %u framing errors, the last frame:\n",
+		serialbytes, serialerrors);
+	printframe();
+}
+
+int main(int argc, char **argv)
+{
+	double duration = 80e9, ppm = 0, nominal = 25e6;
+	int opt, echo = 1;
+
+	pulsetime = 1e9;
+	pulsewidth = 25e6;
+	while ((opt = getopt(argc, argv, "d:c:t:p:o:w:b:ev")) != -1) {
+		switch (opt) {
+			case 'd': duration = atof(optarg) * 1e9; break;
+			case 'c': ppm = atof(optarg); break;
+			case 't': nominal = atof(optarg) * 1e6; break;
+			case 'p': pulseperiod = atof(optarg) * 1e6; break;
+			case 'o': pulsetime = atof(optarg) * 1e6; break;
+			case 'w': pulsewidth = atof(optarg) * 1e6; break;
+			case 'b': vend = atof(optarg); break;
+			case 'e': echo = 0; break;
+			case 'v': verbose = 1; break;
+			default:
+				fprintf(stderr, "usage: %s [-d s] [-c ppm] [-t ms] "
+					"[-p ms] [-o ms] [-w ms] [-b V] [-e] [-v]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	badge_init(&badge, ppm);
+	badge.vdd = vstart;
+	badge.echo = echo;
+	badge.isr = interrupt;
+	badge.onleds = onleds;
+	badge.onpins = onpins;
+	badge.oncarrier = oncarrier;
+	badge_select(&badge);
+	endtime = duration;
+
+	if (!setjmp(finished)) {
+		_sdcc_external_startup();
+		firmware_main();
+	}
+	badge_finish(&badge);
+
+	printf("simulated %.3f s, IHRC error %+.1f ppm\n", duration / 1e9, ppm);
+	if (reportsteps(nominal)) reportcycle();
+	reportleds(duration);
+	reportpower(duration);
+	reportserial();
+	return 0;
+}
@@ -0,0 +1,551 @@
+/*******************************************************************************
+* (c) 2023 by Theo Borm
+* see LICENSE file in the root directory of this repository
+*
+* Multi badge simulation, built and run by "make net" in this directory.
+*
+* Spreads N badges over a square, each with its own clock error and power-on
+* time, and lets them share one IR channel: a badge hears another one when it
+* is within range and the pair is not occluded. Cooperative and antisocial
+* badges can be mixed. The simulation reports how long the cooperative badges
+* take to converge on one phase, how often they transmit, how many carrier
+* marks collide at a receiver and how often the badges reset their sequence.
+*
+* Both firmware variants are linked into one program. The Makefile renames
+* their entry points, localises every other symbol and moves their RAM into
+* sections of their own (cooperative_data, cooperative_bss, ...), so the
+* simulation can swap the RAM of one badge for that of another: every badge
+* runs the same code on its own copy of the firmware's variables, on its own
+* stack. A badge runs until it enters STOPEXE, then the next event in time
+* (on any badge) is handled.
+*
+* Phase is measured from the LED pins: a reference badge is run alone first
+* to learn the sequence of LED states, and every cooperative badge is then
+* followed through that sequence. A jump back to its start is a reset. This
+* needs steps that are visible on the pins, so not a LEDSCAN build.
+*
+* usage: label_net [options]
+*	-n count	badges (50)
+*	-j count	of which antisocial (0)
+*	-a m		side of the square the badges are spread over (20)
+*	-r m		IR range (10)
+*	-x fraction	of the pairs in range that cannot see each other (0.1)
+*	-l fraction	of the transmissions a receiver misses (0)
+*	-c ppm		clock spread, IHRC errors uniform within +-ppm (2000)
+*	-u s		power-on times uniform within this time (30)
+*	-d s		simulated time (300)
+*	-t ms		phase difference still counted as in sync (25)
+*	-q fraction	of the badges in sync to count as converged (0.95)
+*	-s seed		random seed (1)
+*	-v		print the sync state every 10 s
+*******************************************************************************/
+
+#include <math.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include "badge.h"
+#include "steps.h"
+
+#define STACK_SIZE	(64 * 1024)
+#define SAMPLE_TIME	1e9		// sync state sampled every second
+#define REFERENCE_TIME	200e9		// run of the reference badge
+
+typedef struct node node_t;
+
+/*******************************************************************************
+* Firmware images, see the Makefile for the symbols
+*******************************************************************************/
+
+typedef struct {
+	const char *name;
+	unsigned char (*startup)(void);
+	void (*main)(void);
+	void (*isr)(void);
+	char *data, *dataend, *bss, *bssend;
+	size_t datasize, size;
+	uint8_t *image;			// RAM at power-on
+	node_t *loaded;			// the badge whose RAM is loaded
+} firmware_t;
+
+#define FIRMWARE(v) \
+	extern char __start_##v##_data[] __attribute__((weak)); \
+	extern char __stop_##v##_data[] __attribute__((weak)); \
+	extern char __start_##v##_bss[] __attribute__((weak)); \
+	extern char __stop_##v##_bss[] __attribute__((weak)); \
+	unsigned char v##_startup(void); \
+	void v##_main(void); \
+	void v##_interrupt(void);
+#define IMAGE(v) { #v, v##_startup, v##_main, v##_interrupt, \
+	__start_##v##_data, __stop_##v##_data, __start_##v##_bss, __stop_##v##_bss }
+
+FIRMWARE(cooperative)
+FIRMWARE(antisocial)
+
+enum { COOPERATIVE, ANTISOCIAL };
+static firmware_t firmware[] = { IMAGE(cooperative), IMAGE(antisocial) };
+
+static void fwinit(firmware_t *f)
+{
+	f->datasize = f->dataend - f->data;
+	f->size = f->datasize + (f->bssend - f->bss);
+	f->image = malloc(f->size + 1);
+	memcpy(f->image, f->data, f->datasize);
+	memset(f->image + f->datasize, 0, f->size - f->datasize);
+}
+
+static void fwsave(firmware_t *f, uint8_t *ram)
+{
+	memcpy(ram, f->data, f->datasize);
+	memcpy(ram + f->datasize, f->bss, f->size - f->datasize);
+}
+
+static void fwload(firmware_t *f, const uint8_t *ram)
+{
+	memcpy(f->data, ram, f->datasize);
+	memcpy(f->bss, ram + f->datasize, f->size - f->datasize);
+}
+
+/*******************************************************************************
+* Badges
+*******************************************************************************/
+
+struct node {
+	badge_t badge;
+	firmware_t *fw;
+	uint8_t *ram;			// firmware RAM while not loaded
+	ucontext_t context;
+	jmp_buf resume;
+	char *stack;
+	uint8_t started, sleeping;
+	double x, y, poweron;
+
+	node_t **links;			// badges that can see this one
+	uint8_t *hearing;		// per link: receives the current pulse
+	int nlinks, group;
+
+	int pos;			// position in the reference sequence
+	double changed;			// time of the last LED change
+	uint32_t resets, jumps;
+
+	double key;			// time of the next event
+	int heapindex;
+};
+
+static node_t *nodes;
+static int nnodes;
+
+static void load(node_t *n)
+{
+	firmware_t *f = n->fw;
+	badge_select(&n->badge);
+	if (f->loaded == n) return;
+	if (f->loaded) fwsave(f, f->loaded->ram);
+	fwload(f, n->ram);
+	f->loaded = n;
+}
+
+/*******************************************************************************
+* Coroutines: every badge runs main.c on its own stack, STOPEXE switches back
+* to the scheduler. _setjmp/_longjmp switch without a system call, but glibc's
+* fortified longjmp refuses to jump to another stack, hence -U_FORTIFY_SOURCE
+* in the Makefile.
+*******************************************************************************/
+
+static jmp_buf scheduler;
+static node_t *starting;
+
+static void entry(void)
+{
+	node_t *n = starting;
+	n->fw->startup();
+	n->fw->main();
+}
+
+static void resume(node_t *n)
+{
+	n->sleeping = 0;
+	if (_setjmp(scheduler)) return;
+	if (n->started) _longjmp(n->resume, 1);
+	n->started = 1;
+	starting = n;
+	setcontext(&n->context);
+}
+
+void sim_stopexe(void)
+{
+	node_t *n = sim_badge->user;
+	n->badge.wakeups++;
+	badge_update(&n->badge);
+	n->sleeping = 1;
+	if (!_setjmp(n->resume)) _longjmp(scheduler, 1);
+}
+
+/*******************************************************************************
+* Event queue: a binary heap of badges on the time of their next event
+*******************************************************************************/
+
+static node_t **heap;
+static int heapsize;
+
+static double nodekey(node_t *n)
+{
+	return n->started ? badge_nextevent(&n->badge) : n->poweron;
+}
+
+static void heapswap(int i, int j)
+{
+	node_t *t = heap[i];
+	heap[i] = heap[j];
+	heap[j] = t;
+	heap[i]->heapindex = i;
+	heap[j]->heapindex = j;
+}
+
+static void heapupdate(node_t *n)
+{
+	int i = n->heapindex;
+	n->key = nodekey(n);
+	while (i > 0 && heap[(i - 1) / 2]->key > heap[i]->key) {
+		heapswap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+	for (;;) {
+		int c = 2 * i + 1;
+		if (c >= heapsize) break;
+		if (c + 1 < heapsize && heap[c + 1]->key < heap[c]->key) c++;
+		if (heap[c]->key >= heap[i]->key) break;
+		heapswap(i, c);
+		i = c;
+	}
+}
+
+/*******************************************************************************
+* IR channel
+*******************************************************************************/
+
+static double loss;
+
+static double uniform(void)
+{
+	return rand() / (RAND_MAX + 1.0);
+}
+
+static void oncarrier(badge_t *b, double time, int on)
+{
+	node_t *n = b->user;
+	for (int i = 0; i < n->nlinks; i++) {
+		node_t *m = n->links[i];
+		// a whole transmission is heard or missed, not single marks
+		if (on && time - b->carrierstop > SIM_BURST_GAP)
+			n->hearing[i] = m->started && uniform() >= loss;
+		if (!n->hearing[i]) continue;
+		badge_receive(&m->badge, time, on);
+		heapupdate(m);
+	}
+}
+
+static void addlink(node_t *a, node_t *b)
+{
+	a->links = realloc(a->links, (a->nlinks + 1) * sizeof *a->links);
+	a->hearing = realloc(a->hearing, a->nlinks + 1);
+	a->links[a->nlinks++] = b;
+}
+
+// groups of cooperative badges that can reach each other, possibly via others
+static int findgroups(void)
+{
+	int groups = 0, *stack = malloc(nnodes * sizeof *stack);
+	for (int i = 0; i < nnodes; i++) nodes[i].group = -1;
+	for (int i = 0; i < nnodes; i++) {
+		int top = 0;
+		if (nodes[i].group >= 0 || nodes[i].fw != &firmware[COOPERATIVE]) continue;
+		nodes[i].group = groups;
+		stack[top++] = i;
+		while (top) {
+			node_t *n = &nodes[stack[--top]];
+			for (int k = 0; k < n->nlinks; k++) {
+				node_t *m = n->links[k];
+				if (m->group >= 0 || m->fw != &firmware[COOPERATIVE]) continue;
+				m->group = groups;
+				stack[top++] = m - nodes;
+			}
+		}
+		groups++;
+	}
+	free(stack);
+	return groups;
+}
+
+/*******************************************************************************
+* Phase: following the badges through the reference LED sequence
+*******************************************************************************/
+
+static steps_t reference;
+static size_t period;			// LED changes in one sequence
+static double cycle;			// length of the sequence
+
+static uint64_t refleds(size_t i)
+{
+	return reference.step[i % period].leds;
+}
+
+static void onleds(badge_t *b, double time, uint64_t leds)
+{
+	node_t *n = b->user;
+	if (!period) {
+		steps_add(&reference, time, leds);
+		return;
+	}
+	if (n->pos >= 0 && leds == refleds(n->pos + 1))
+		n->pos = (n->pos + 1) % period;
+	else if (leds == refleds(0) || leds == refleds(1)) {
+		// the sequence restarted, possibly on the LEDs already lit
+		if (n->pos >= 0) n->resets++;
+		n->pos = leds == refleds(0) ? 0 : 1;
+	} else {
+		size_t i;
+		for (i = 0; i < period && refleds(i) != leds; i++);
+		n->pos = i < period ? (int)i : -1;
+		n->jumps++;
+	}
+	n->changed = time;
+}
+
+static double phase(node_t *n, double time)
+{
+	double start = n->pos ? reference.step[n->pos].time - reference.step[0].time : 0;
+	double end = n->pos + 1 < (int)period ?
+		reference.step[n->pos + 1].time - reference.step[0].time : cycle;
+	double t = start + time - n->changed;
+	return t < end ? t : end;
+}
+
+static int cmpdouble(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+// the most badges of a group whose phases fit in a window of tolerance
+static int largestcluster(double *p, int count, double tolerance)
+{
+	int best = 0;
+	qsort(p, count, sizeof *p, cmpdouble);
+	for (int i = 0, j = 0; i < count; i++) {
+		if (j < i) j = i;
+		while (j + 1 < i + count && p[(j + 1) % count]
+				+ (j + 1 >= count ? cycle : 0) - p[i] <= tolerance)
+			j++;
+		if (j - i + 1 > best) best = j - i + 1;
+	}
+	return best;
+}
+
+static int ngroups, ncooperative, verbose;
+static double tolerance, quorum, lastpoweron, unconverged, synced;
+
+static void sample(double time)
+{
+	double *p = malloc(nnodes * sizeof *p);
+	int insync = 0;
+
+	for (int g = 0; g < ngroups; g++) {
+		int count = 0;
+		for (int i = 0; i < nnodes; i++) {
+			node_t *n = &nodes[i];
+			if (n->group == g && n->started && n->pos >= 0)
+				p[count++] = phase(n, time);
+		}
+		insync += largestcluster(p, count, tolerance);
+	}
+	free(p);
+	synced = (double)insync / ncooperative;
+	if (synced < quorum || time < lastpoweron) unconverged = time;
+	if (verbose && fmod(time, 10e9) < SAMPLE_TIME / 2)
+		printf("%7.1f s  %5.1f%% in sync\n", time / 1e9, 100 * synced);
+}
+
+/*******************************************************************************
+* Simulation
+*******************************************************************************/
+
+static void setup(node_t *n, firmware_t *f, double ppm, double poweron)
+{
+	memset(n, 0, sizeof *n);
+	badge_init(&n->badge, ppm);
+	n->badge.isr = f->isr;
+	n->badge.onleds = onleds;
+	n->badge.oncarrier = oncarrier;
+	n->badge.user = n;
+	n->badge.now = poweron;
+	n->fw = f;
+	n->ram = malloc(f->size + 1);
+	memcpy(n->ram, f->image, f->size);
+	n->poweron = poweron;
+	n->pos = -1;
+	n->stack = malloc(STACK_SIZE);
+	getcontext(&n->context);
+	n->context.uc_stack.ss_sp = n->stack;
+	n->context.uc_stack.ss_size = STACK_SIZE;
+	n->context.uc_link = NULL;
+	makecontext(&n->context, entry, 0);
+}
+
+static void simulate(double endtime, void (*sampler)(double))
+{
+	double nextsample = SAMPLE_TIME;
+
+	heap = realloc(heap, nnodes * sizeof *heap);
+	heapsize = nnodes;
+	for (int i = 0; i < nnodes; i++) {
+		heap[i] = &nodes[i];
+		nodes[i].heapindex = i;
+		nodes[i].key = INFINITY;
+	}
+	for (int i = 0; i < nnodes; i++) heapupdate(&nodes[i]);
+
+	while (heap[0]->key <= endtime) {
+		node_t *n = heap[0];
+		for (; sampler && nextsample <= n->key; nextsample += SAMPLE_TIME)
+			sampler(nextsample);
+		load(n);
+		if (!n->started)
+			resume(n);
+		else if (badge_event(&n->badge) && n->sleeping)
+			resume(n);
+		heapupdate(n);
+	}
+	for (; sampler && nextsample <= endtime; nextsample += SAMPLE_TIME)
+		sampler(nextsample);
+	for (int i = 0; i < nnodes; i++) {
+		badge_settime(&nodes[i].badge, endtime);
+		badge_finish(&nodes[i].badge);
+	}
+}
+
+// learn the LED sequence from a cooperative badge on its own
+static void learnsequence(void)
+{
+	node_t ref;
+	nodes = &ref;
+	nnodes = 1;
+	setup(&ref, &firmware[COOPERATIVE], 0, 0);
+	simulate(REFERENCE_TIME, NULL);
+	firmware[COOPERATIVE].loaded = NULL;
+	// LEDs that change more than once per 10 ms are being multiplexed
+	period = reference.n < REFERENCE_TIME / 10e6 ? steps_period(&reference) : 0;
+	if (period)
+		cycle = reference.step[1 + period].time - reference.step[1].time;
+}
+
+int main(int argc, char **argv)
+{
+	int count = 50, antisocial = 0, opt, links = 0;
+	double side = 20, range = 10, occlusion = 0.1, spread = 2000;
+	double poweron = 30e9, duration = 300e9, transmissions = 0;
+	uint32_t receptions = 0, collisions = 0, histogram[11] = { 0 };
+	unsigned seed = 1;
+
+	tolerance = 25e6;
+	quorum = 0.95;
+	while ((opt = getopt(argc, argv, "n:j:a:r:x:l:c:u:d:t:q:s:v")) != -1) {
+		switch (opt) {
+			case 'n': count = atoi(optarg); break;
+			case 'j': antisocial = atoi(optarg); break;
+			case 'a': side = atof(optarg); break;
+			case 'r': range = atof(optarg); break;
+			case 'x': occlusion = atof(optarg); break;
+			case 'l': loss = atof(optarg); break;
+			case 'c': spread = atof(optarg); break;
+			case 'u': poweron = atof(optarg) * 1e9; break;
+			case 'd': duration = atof(optarg) * 1e9; break;
+			case 't': tolerance = atof(optarg) * 1e6; break;
+			case 'q': quorum = atof(optarg); break;
+			case 's': seed = atoi(optarg); break;
+			case 'v': verbose = 1; break;
+			default:
+				fprintf(stderr, "usage: %s [-n count] [-j count] [-a m] "
+					"[-r m] [-x fraction] [-l fraction] [-c ppm] [-u s] "
+					"[-d s] [-t ms] [-q fraction] [-s seed] [-v]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (count < 1 || antisocial > count) {
+		fprintf(stderr, "%s: need at least one badge\n", argv[0]);
+		return 1;
+	}
+
+	for (int i = 0; i < 2; i++) fwinit(&firmware[i]);
+	learnsequence();
+	if (!period) {
+		printf("the LED sequence is not visible on the pins (LEDSCAN?), "
+			"phase cannot be followed\n");
+		return 1;
+	}
+
+	srand(seed);
+	nnodes = count;
+	nodes = calloc(nnodes, sizeof *nodes);
+	ncooperative = count - antisocial;
+	lastpoweron = 0;
+	for (int i = 0; i < nnodes; i++) {
+		double on = uniform() * poweron;
+		setup(&nodes[i], &firmware[i < antisocial ? ANTISOCIAL : COOPERATIVE],
+			(2 * uniform() - 1) * spread, on);
+		nodes[i].x = uniform() * side;
+		nodes[i].y = uniform() * side;
+		if (on > lastpoweron) lastpoweron = on;
+	}
+	for (int i = 0; i < nnodes; i++)
+		for (int k = i + 1; k < nnodes; k++) {
+			double dx = nodes[i].x - nodes[k].x, dy = nodes[i].y - nodes[k].y;
+			if (dx * dx + dy * dy > range * range || uniform() < occlusion)
+				continue;
+			addlink(&nodes[i], &nodes[k]);
+			addlink(&nodes[k], &nodes[i]);
+			links += 2;
+		}
+	ngroups = findgroups();
+
+	simulate(duration, ncooperative ? sample : NULL);
+
+	for (int i = 0; i < nnodes; i++) {
+		node_t *n = &nodes[i];
+		receptions += n->badge.receptions;
+		collisions += n->badge.collisions;
+		if (n->fw != &firmware[COOPERATIVE]) continue;
+		transmissions += n->badge.bursts;
+		histogram[n->resets < 10 ? n->resets : 10]++;
+	}
+
+	printf("badges: %d cooperative, %d antisocial, %.0f x %.0f m, range %.1f m, "
+		"%.1f links per badge, %d cooperative groups\n", ncooperative,
+		antisocial, side, side, range, (double)links / nnodes, ngroups);
+	printf("simulated %.1f s, power-on within %.1f s, clock spread +-%.0f ppm, "
+		"sequence %.3f ms\n", duration / 1e9, poweron / 1e9, spread,
+		cycle / 1e6);
+	if (ncooperative && synced >= quorum)
+		printf("converged: after %.1f s (%.1f s after the last power-on), "
+			"%.1f%% in sync at the end\n", (unconverged + SAMPLE_TIME) / 1e9,
+			(unconverged + SAMPLE_TIME - lastpoweron) / 1e9, 100 * synced);
+	else if (ncooperative)
+		printf("converged: no, %.1f%% in sync at the end\n", 100 * synced);
+	printf("transmissions: %.2f per minute, %.3f per cooperative badge per "
+		"minute\n", transmissions / (duration / 60e9), ncooperative ?
+		transmissions / ncooperative / (duration / 60e9) : 0);
+	printf("collisions: %u of %u received carrier marks (%.2f%%)\n", collisions,
+		receptions, receptions ? 100.0 * collisions / receptions : 0);
+	printf("resets per cooperative badge:\n");
+	for (int i = 0; i <= 10; i++) {
+		printf("%s%2d: %5u ", i == 10 ? ">=" : "  ", i, histogram[i]);
+		for (uint32_t k = 0; k < (histogram[i] * 50 + ncooperative - 1)
+				/ (ncooperative ? ncooperative : 1); k++)
+			putchar('#');
+		putchar('\n');
+	}
+	return 0;
+}
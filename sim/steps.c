@@ -0,0 +1,40 @@
+/*******************************************************************************
+* (c) 2023 by Theo Borm
+* see LICENSE file in the root directory of this repository
+*
+* Recording of LED steps, see steps.h
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "steps.h"
+
+void steps_add(steps_t *s, double time, uint64_t leds)
+{
+	if (s->n == s->max) {
+		s->max = s->max ? 2 * s->max : 4096;
+		s->step = realloc(s->step, s->max * sizeof *s->step);
+		if (!s->step) {
+			perror("sim");
+			exit(1);
+		}
+	}
+	s->step[s->n].time = time;
+	s->step[s->n].leds = leds;
+	s->n++;
+}
+
+// the shortest number of changes after which the recorded LED states repeat,
+// 0 if they do not repeat within the recording
+size_t steps_period(const steps_t *s)
+{
+	size_t period, i;
+
+	if (s->n < 100) return 0;
+	for (period = 1; 2 * period < s->n; period++) {
+		for (i = 0; i + period < s->n; i++)
+			if (s->step[i].leds != s->step[i + period].leds) break;
+		if (i + period == s->n) return period;
+	}
+	return 0;
+}
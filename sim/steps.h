@@ -0,0 +1,27 @@
+/*******************************************************************************
+* (c) 2023 by Theo Borm
+* see LICENSE file in the root directory of this repository
+*
+* Recording of LED steps: every change of the lit LEDs, with its time
+*******************************************************************************/
+
+#ifndef SIM_STEPS_H
+#define SIM_STEPS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+	double time;
+	uint64_t leds;
+} step_t;
+
+typedef struct {
+	step_t *step;
+	size_t n, max;
+} steps_t;
+
+void steps_add(steps_t *s, double time, uint64_t leds);
+size_t steps_period(const steps_t *s);
+
+#endif
@@ -0,0 +1,457 @@
+/*******************************************************************************
+* (c) 2023 by Theo Borm
+* see LICENSE file in the root directory of this repository
+*
+* Pattern compiler, built and run by the Makefile of a variant.
+*
+* Reads the patterns and the sequence from a text description (see
+* cooperative/patterns.txt for the format) and writes the header with the ROM
+* tables main.c plays: ledsequence[], runs[], PATTERNS() and SEQUENCE(). Runs
+* a pattern shares with the patterns before it, as a slice of consecutive runs,
+* are not stored again. Everything main.c packs into bit fields is checked
+* here, so a description that compiles plays as written.
+*
+* It reports, for every pattern, the ROM words it adds, how long one play and
+* all its plays in the sequence take and how many LEDs it lights, and fails
+* when the tables need more than the budget. ROM holds every constant byte as
+* one instruction word, so words are bytes of table here.
+*
+* usage: patc [options] patterns.txt
+*	-o file		the header to write, only touched when it changes
+*			(patterns.h)
+*	-w words	ROM budget of the tables (0 = none)
+*	-q		no report
+*******************************************************************************/
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// the limits of main.c, see the patterns there
+#define RUN_STEPS	20		// steps in a run
+#define LED_OFF		20		// LED index that switches a side off
+#define MAX_RUNS	32		// runs[] index in 5 bits
+#define MAX_COUNT	8		// runs of a pattern in 3 bits
+#define MAX_START	0x3f		// track start in 6 bits
+#define MAX_TABLE	51		// ledtable() computes n*5 in 8 bits
+#define MAX_TICKS	32767		// <name>_TICKS is an int
+#define MAX_SEQUENCE	0xfffe		// phases are 16 bit, below JOIN_PHASE
+#define MAX_STEP	125		// ms, plus slew and 128 late in elapsed8()
+
+#define TRACK_DOWN	0x80
+#define TRACK_TABLE	0x40
+#define TRACK_START	0x3f
+#define TRACK_OFF	LED_OFF
+
+#define MAX_PATTERNS	64
+#define MAX_PARTS	64
+#define MAX_NAME	32
+#define MAX_HEADER	16384
+
+typedef struct {
+	uint8_t left, right;
+} run_t;
+
+typedef struct {
+	char name[MAX_NAME];
+	int line;
+	int steptime;
+	int count;
+	run_t run[MAX_COUNT];
+	int first;			// in runs[]
+	int added;			// runs it adds to runs[]
+	int plays;			// in the whole sequence
+} pattern_t;
+
+static const char *source;
+static int line;
+
+static int table[MAX_TABLE], tablesize;
+static pattern_t pattern[MAX_PATTERNS];
+static int patterns;
+static struct { int pattern, repeats; } part[MAX_PARTS];
+static int parts;
+static run_t runs[MAX_RUNS];
+static int runcount;
+
+static void fail(const char *format, ...)
+{
+	va_list args;
+
+	fprintf(stderr, "%s:%d: ", source, line);
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+/*******************************************************************************
+* Parsing: one statement per line, words separated by blanks, # comments
+*******************************************************************************/
+
+static char *word(char **p)
+{
+	char *w;
+
+	while (isspace((unsigned char)**p)) (*p)++;
+	if (!**p) return NULL;
+	w = *p;
+	while (**p && !isspace((unsigned char)**p)) (*p)++;
+	if (**p) *(*p)++ = 0;
+	return w;
+}
+
+static int number(char **p, const char *what, int min, int max)
+{
+	char *w = word(p), *end;
+	long n;
+
+	if (!w) fail("%s missing", what);
+	n = strtol(w, &end, 10);
+	if (*end || end == w) fail("%s: \"%s\" is not a number", what, w);
+	if (n < min || n > max) fail("%s %ld out of range %d..%d", what, n, min, max);
+	return n;
+}
+
+static pattern_t *findpattern(const char *name)
+{
+	for (int i = 0; i < patterns; i++)
+		if (!strcmp(pattern[i].name, name)) return &pattern[i];
+	return NULL;
+}
+
+// a track: off, up <n>, down <n>, table up <n> or table down <n>
+static uint8_t track(char **p)
+{
+	char *w = word(p);
+	uint8_t t = 0;
+	int n;
+
+	if (!w) fail("track missing");
+	if (!strcmp(w, "off")) return TRACK_OFF;
+	if (!strcmp(w, "table")) {
+		t |= TRACK_TABLE;
+		if (!(w = word(p))) fail("table track without direction");
+	}
+	if (!strcmp(w, "down")) t |= TRACK_DOWN;
+	else if (strcmp(w, "up")) fail("unknown track \"%s\"", w);
+	if (t & TRACK_TABLE) {
+		// every step of the run must stay inside the table
+		n = number(p, "table start", 0, MAX_START);
+		if (!tablesize) fail("table track without a table");
+		if (t & TRACK_DOWN ? n < RUN_STEPS - 1 || n >= tablesize
+				: n + RUN_STEPS > tablesize)
+			fail("table track %s %d leaves the %d entries of the table",
+				t & TRACK_DOWN ? "down" : "up", n, tablesize);
+	} else {
+		n = number(p, "LED", 0, LED_OFF - 1);
+	}
+	return t | n;
+}
+
+static void parse(FILE *f)
+{
+	char text[256], *p, *w;
+	pattern_t *pat = NULL;
+
+	for (line = 1; fgets(text, sizeof text, f); line++) {
+		if ((p = strchr(text, '#'))) *p = 0;
+		p = text;
+		if (!(w = word(&p))) continue;
+
+		if (!strcmp(w, "table")) {
+			if (patterns) fail("the table comes before the patterns");
+			while (*p) {
+				if (tablesize == MAX_TABLE)
+					fail("more than %d table entries", MAX_TABLE);
+				table[tablesize++] = number(&p, "table LED", 0, LED_OFF - 1);
+				while (isspace((unsigned char)*p)) p++;
+			}
+		} else if (!strcmp(w, "pattern")) {
+			if (parts) fail("patterns come before the sequence");
+			if (patterns == MAX_PATTERNS) fail("too many patterns");
+			if (!(w = word(&p))) fail("pattern name missing");
+			if (findpattern(w)) fail("pattern %s defined twice", w);
+			if (strlen(w) >= MAX_NAME || !isalpha((unsigned char)*w))
+				fail("bad pattern name \"%s\"", w);
+			for (char *c = w; *c; c++)
+				if (!isalnum((unsigned char)*c)) fail("bad pattern name \"%s\"", w);
+			pat = &pattern[patterns++];
+			strcpy(pat->name, w);
+			pat->line = line;
+			pat->steptime = number(&p, "ms per step", 1, MAX_STEP);
+		} else if (!strcmp(w, "run")) {
+			if (!pat || parts) fail("run outside a pattern");
+			if (pat->count == MAX_COUNT)
+				fail("pattern %s has more than %d runs", pat->name, MAX_COUNT);
+			pat->run[pat->count].left = track(&p);
+			pat->run[pat->count].right = track(&p);
+			pat->count++;
+		} else if (!strcmp(w, "play")) {
+			pattern_t *played;
+			if (!(w = word(&p))) fail("play without a pattern");
+			if (!(played = findpattern(w))) fail("unknown pattern %s", w);
+			if (parts == MAX_PARTS) fail("too many parts in the sequence");
+			part[parts].pattern = played - pattern;
+			part[parts].repeats = number(&p, "plays", 1, 255);
+			played->plays += part[parts].repeats;
+			parts++;
+		} else {
+			fail("unknown statement \"%s\"", w);
+		}
+		if (word(&p)) fail("extra words at the end of the line");
+	}
+	line--;
+	if (!parts) fail("no sequence");
+}
+
+/*******************************************************************************
+* Layout of runs[]: a pattern reuses a slice of the runs stored so far, or its
+* runs are appended
+*******************************************************************************/
+
+static void layout(void)
+{
+	for (int i = 0; i < patterns; i++) {
+		pattern_t *pat = &pattern[i];
+		line = pat->line;
+		if (!pat->count) fail("pattern %s has no runs", pat->name);
+		if (pat->count * RUN_STEPS * pat->steptime > MAX_TICKS)
+			fail("one play of pattern %s takes more than %d ms",
+				pat->name, MAX_TICKS);
+		pat->first = -1;
+		for (int first = 0; first + pat->count <= runcount && pat->first < 0; first++)
+			if (!memcmp(&runs[first], pat->run, pat->count * sizeof(run_t)))
+				pat->first = first;
+		if (pat->first >= 0) continue;
+		if (runcount + pat->count > MAX_RUNS)
+			fail("pattern %s needs more than %d runs", pat->name, MAX_RUNS);
+		pat->first = runcount;
+		pat->added = pat->count;
+		memcpy(&runs[runcount], pat->run, pat->count * sizeof(run_t));
+		runcount += pat->count;
+	}
+}
+
+/*******************************************************************************
+* Output
+*******************************************************************************/
+
+static void upper(char *to, const char *from)
+{
+	while ((*to++ = toupper((unsigned char)*from++)));
+}
+
+static int printtrack(char *s, uint8_t t)
+{
+	if (t == TRACK_OFF) return sprintf(s, "TRACK_OFF");
+	return sprintf(s, "%sTRACK_%s | %d", t & TRACK_TABLE ? "TRACK_TABLE | " : "",
+		t & TRACK_DOWN ? "DOWN" : "UP", t & TRACK_START);
+}
+
+// appends tabs to text (after a leading tab) up to column, at least one
+static void tabto(char *s, int column)
+{
+	int n = 8 + strlen(s);
+
+	do {
+		strcat(s, "\t");
+		n = (n / 8 + 1) * 8;
+	} while (n < column);
+}
+
+static char *generate(const char *input)
+{
+	static char out[MAX_HEADER];
+	char text[256], name[MAX_NAME];
+	int n = 0;
+
+	n += sprintf(out + n, "/*******************************************************************************\n"
+		"* Generated from %s by the pattern compiler (tools/patc.c), edit that\n"
+		"* instead. The patterns and the sequence as main.c plays them, see there.\n"
+		"*/\n\n", input);
+
+	n += sprintf(out + n, "#define LEDTABLE_SIZE\t%d\t\t// indices in ledsequence[]\n\n",
+		tablesize);
+	n += sprintf(out + n, "const uint8_t ledsequence[] = {\n");
+	for (int i = 0; i < tablesize || i == 0; i += 8) {
+		n += sprintf(out + n, "\tPACK5(");
+		for (int j = i; j < i + 8; j++)
+			n += sprintf(out + n, "%2d%s", j < tablesize ? table[j] : 0,
+				j < i + 7 ? "," : "");
+		n += sprintf(out + n, ")%s\n", i + 8 < tablesize ? "," : "");
+	}
+	n += sprintf(out + n, "};\n\n");
+
+	n += sprintf(out + n, "const run_t runs[] = {\n");
+	for (int i = 0; i < runcount; i++) {
+		int m = sprintf(text, "{ ");
+		m += printtrack(text + m, runs[i].left);
+		m += sprintf(text + m, ", ");
+		m += printtrack(text + m, runs[i].right);
+		sprintf(text + m, " }%s", i + 1 < runcount ? "," : "");
+		for (int j = 0; j < patterns; j++) {
+			if (!pattern[j].added || pattern[j].first != i) continue;
+			tabto(text, 64);
+			snprintf(text + strlen(text), sizeof text - strlen(text),
+				"// %d: %.31s", i, pattern[j].name);
+		}
+		n += sprintf(out + n, "\t%s\n", text);
+	}
+	n += sprintf(out + n, "};\n\n");
+
+	n += sprintf(out + n, "#define PATTERNS(X)");
+	for (int i = 0; i < patterns; i++) {
+		upper(name, pattern[i].name);
+		sprintf(text, "X(%s,", name);
+		tabto(text, 32);
+		n += sprintf(out + n, " \\\n\t%s%d, %d, %d)", text, pattern[i].first,
+			pattern[i].count, pattern[i].steptime);
+	}
+	n += sprintf(out + n, "\n\n#define SEQUENCE(X)");
+	for (int i = 0; i < parts; i++) {
+		upper(name, pattern[part[i].pattern].name);
+		sprintf(text, "X(%s,", name);
+		tabto(text, 32);
+		n += sprintf(out + n, " \\\n\t%s%d)", text, part[i].repeats);
+	}
+	sprintf(out + n, "\n");
+	return out;
+}
+
+// writes the header unless it already holds exactly this
+static void writeheader(const char *file, const char *text)
+{
+	static char old[MAX_HEADER];
+	FILE *f = fopen(file, "r");
+	size_t length = 0;
+
+	if (f) {
+		length = fread(old, 1, sizeof old - 1, f);
+		old[length] = 0;
+		fclose(f);
+		if (!strcmp(old, text)) return;
+	}
+	if (!(f = fopen(file, "w")) || fputs(text, f) < 0 || fclose(f)) {
+		perror(file);
+		exit(1);
+	}
+}
+
+/*******************************************************************************
+* Report: what main.c does with the runs, step by step (see ledindex() and
+* setled() there). A side starts a pattern dark; an index above LED_OFF
+* leaves the side as it is.
+*******************************************************************************/
+
+static int ledindex(uint8_t t, int i)
+{
+	uint8_t n = t & TRACK_START;
+
+	if (t & TRACK_TABLE) return table[(uint8_t)(t & TRACK_DOWN ? n - i : n + i)];
+	if (n >= LED_OFF) return LED_OFF;
+	return (uint8_t)(t & TRACK_DOWN ? n - i : n + i);
+}
+
+static int report(int print, int budget)
+{
+	int total;
+	int steps, lit, sequence = 0;
+	int tablewords = (tablesize ? (tablesize + 7) / 8 : 1) * 5;
+	int runwords = 0, patternwords = 2 * patterns, sequencewords = 2 * parts;
+
+	for (int i = 0; i < parts; i++)
+		sequence += part[i].repeats * pattern[part[i].pattern].count
+			* RUN_STEPS * pattern[part[i].pattern].steptime;
+	if (sequence > MAX_SEQUENCE) {
+		fprintf(stderr, "%s: the sequence takes %d ms, more than %d\n",
+			source, sequence, MAX_SEQUENCE);
+		exit(1);
+	}
+	if (print) printf("%-16s runs  ROM  play ms  plays  total ms   seq  LEDs lit  "
+		"max LED\n", "pattern");
+	for (int i = 0; i < patterns; i++) {
+		pattern_t *pat = &pattern[i];
+		int on[2 * LED_OFF] = { 0 }, worst = 0;
+		int left = LED_OFF, right = LED_OFF;
+		int play = pat->count * RUN_STEPS * pat->steptime;
+
+		runwords += 2 * pat->added;
+		lit = 0;
+		steps = pat->count * RUN_STEPS;
+		for (int r = 0; r < pat->count; r++) {
+			for (int s = 0; s < RUN_STEPS; s++) {
+				int l = ledindex(pat->run[r].left, s);
+				int h = ledindex(pat->run[r].right, s);
+				if (l <= LED_OFF) left = l;
+				if (h <= LED_OFF) right = h;
+				if (left < LED_OFF) lit++, on[left]++;
+				if (right < LED_OFF) lit++, on[LED_OFF + right]++;
+			}
+		}
+		for (int k = 0; k < 2 * LED_OFF; k++)
+			if (on[k] > on[worst]) worst = k;
+		if (!pat->plays)
+			fprintf(stderr, "%s:%d: warning: pattern %s is not played\n",
+				source, pat->line, pat->name);
+		if (!print) continue;
+		printf("%-16s %2d-%-2d %3d  %7d  %5d  %8d  %3.0f%%  %8.2f  %c%02d %3.0f%%\n",
+			pat->name, pat->first, pat->first + pat->count - 1,
+			2 * pat->added + 2, play, pat->plays, pat->plays * play,
+			100.0 * pat->plays * play / sequence, (double)lit / steps,
+			worst < LED_OFF ? 'L' : 'R', worst % LED_OFF,
+			100.0 * on[worst] / steps);
+	}
+	total = tablewords + runwords + patternwords + sequencewords;
+	if (!print) return total;
+	printf("ROM: table %d, runs %d, patterns %d, sequence %d, %d words",
+		tablewords, runwords, patternwords, sequencewords, total);
+	if (budget) printf(" of %d", budget);
+	printf("; sequence %d ms\n", sequence);
+	return total;
+}
+
+int main(int argc, char **argv)
+{
+	const char *output = "patterns.h";
+	int opt, budget = 0, quiet = 0, total;
+	FILE *f;
+
+	while ((opt = getopt(argc, argv, "o:w:q")) != -1) {
+		switch (opt) {
+			case 'o': output = optarg; break;
+			case 'w': budget = atoi(optarg); break;
+			case 'q': quiet = 1; break;
+			default:
+				fprintf(stderr, "usage: %s [-o header] [-w words] [-q] "
+					"patterns.txt\n", argv[0]);
+				return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "usage: %s [-o header] [-w words] [-q] patterns.txt\n",
+			argv[0]);
+		return 1;
+	}
+	source = argv[optind];
+	if (!(f = fopen(source, "r"))) {
+		perror(source);
+		return 1;
+	}
+	parse(f);
+	fclose(f);
+	layout();
+	total = report(!quiet, budget);
+	if (budget && total > budget) {
+		fprintf(stderr, "%s: the tables need %d ROM words, more than the "
+			"budget of %d\n", source, total, budget);
+		return 1;
+	}
+	writeheader(output, generate(source));
+	return 0;
+}